@@ -45,6 +45,16 @@
 
 #include "Adafruit_NeoPixel.h"
 
+#if defined(ESP_PLATFORM)
+// report the pixel buffer to the firmware's memory telemetry
+#include "mem_telemetry.h"
+#define NEO_MEM_ALLOC(bytes) mem_telemetry_alloc(MEM_NEOPIXEL, bytes)
+#define NEO_MEM_FREE(bytes) mem_telemetry_free(MEM_NEOPIXEL, bytes)
+#else
+#define NEO_MEM_ALLOC(bytes)
+#define NEO_MEM_FREE(bytes)
+#endif
+
 #if defined(TARGET_LPC1768)
 #include <time.h>
 #endif
@@ -78,7 +88,13 @@
   @return  Adafruit_NeoPixel object. Call the begin() function before use.
 */
 Adafruit_NeoPixel::Adafruit_NeoPixel(uint16_t n, int16_t p, neoPixelType t)
-    : begun(false), brightness(0), pixels(NULL), endTime(0) {
+    : begun(false), brightness(0), pixels(NULL), frontPixels(NULL), endTime(0) {
+#if defined(ESP32)
+  rmtHandle = -1;
+  outputBrightness = 0;
+  gammaOn = false;
+  levelsDirty = true;
+#endif
   updateType(t);
   updateLength(n);
   setPin(p);
@@ -110,22 +126,48 @@ Adafruit_NeoPixel::Adafruit_NeoPixel()
       is800KHz(true),
 #endif
       begun(false), numLEDs(0), numBytes(0), pin(-1), brightness(0),
-      pixels(NULL), rOffset(1), gOffset(0), bOffset(2), wOffset(1), endTime(0) {
+      pixels(NULL), frontPixels(NULL), rOffset(1), gOffset(0), bOffset(2), wOffset(1), endTime(0) {
+#if defined(ESP32)
+  rmtHandle = -1;
+  outputBrightness = 0;
+  gammaOn = false;
+  levelsDirty = true;
+#endif
 }
 
 /*!
   @brief   Deallocate Adafruit_NeoPixel object, set data pin back to INPUT.
 */
 Adafruit_NeoPixel::~Adafruit_NeoPixel() {
+#if defined(ESP32)
+  if (rmtHandle >= 0)
+    espEnd(rmtHandle);
+#endif
+  if (pixels)
+    NEO_MEM_FREE(numBytes);
   free(pixels);
+  if (frontPixels)
+    NEO_MEM_FREE(numBytes);
+  free(frontPixels);
   if (pin >= 0)
     pinMode(pin, INPUT);
 }
 
 /*!
-  @brief   Configure NeoPixel pin for output.
+  @brief   Configure NeoPixel pin for output. On ESP32 this also sets up an
+           RMT channel that the strip keeps until it is destroyed, so show()
+           doesn't install and remove the driver for every frame.
 */
 void Adafruit_NeoPixel::begin(void) {
+#if defined(ESP32)
+  // pinMode() would take the pin away from the RMT
+  if (pin >= 0 && rmtHandle < 0)
+    rmtHandle = espBegin(pin, is800KHz);
+  if (rmtHandle >= 0) {
+    begun = true;
+    return;
+  }
+#endif
   if (pin >= 0) {
     pinMode(pin, OUTPUT);
     digitalWrite(pin, LOW);
@@ -144,6 +186,10 @@ void Adafruit_NeoPixel::begin(void) {
            type).
 */
 void Adafruit_NeoPixel::updateLength(uint16_t n) {
+  bool doubleBuffered = (frontPixels != NULL);
+  setDoubleBuffer(false);
+  if (pixels)
+    NEO_MEM_FREE(numBytes);
   free(pixels); // Free existing data (if any)
 
   // Allocate new data -- note: ALL PIXELS ARE CLEARED
@@ -151,11 +197,49 @@ void Adafruit_NeoPixel::updateLength(uint16_t n) {
   if ((pixels = (uint8_t *)malloc(numBytes))) {
     memset(pixels, 0, numBytes);
     numLEDs = n;
+    NEO_MEM_ALLOC(numBytes);
+    if (doubleBuffered)
+      setDoubleBuffer(true);
   } else {
     numLEDs = numBytes = 0;
   }
 }
 
+/*!
+  @brief   Switch between one pixel buffer and a front/back pair. When
+           double buffered, setPixelColor() and friends draw into the back
+           buffer while showAsync() clocks out the front one, and showAsync()
+           swaps them, so the next frame can be rendered while the previous
+           one is still being sent. The new back buffer starts as a copy of
+           the frame just shown.
+  @param   on  true for front/back buffers, false for the single buffer.
+  @return  true on success, false if the second buffer couldn't be
+           allocated (the strip stays single buffered).
+*/
+bool Adafruit_NeoPixel::setDoubleBuffer(bool on) {
+  if (on == (frontPixels != NULL))
+    return true;
+  // The front buffer may still be going out: block on the RMT until it has,
+  // then only the latch is left to wait out
+#if defined(ESP32)
+  if (rmtHandle >= 0)
+    espWait(rmtHandle);
+#endif
+  while (!canShow())
+    ;
+  if (!on) {
+    NEO_MEM_FREE(numBytes);
+    free(frontPixels);
+    frontPixels = NULL;
+    return true;
+  }
+  if (!pixels || !(frontPixels = (uint8_t *)malloc(numBytes)))
+    return false;
+  memcpy(frontPixels, pixels, numBytes);
+  NEO_MEM_ALLOC(numBytes);
+  return true;
+}
+
 /*!
   @brief   Change the pixel format of a previously-declared
            Adafruit_NeoPixel strip object. If format changes from one of
@@ -183,6 +267,13 @@ void Adafruit_NeoPixel::updateType(neoPixelType t) {
 #if defined(NEO_KHZ400)
   is800KHz = (t < 256); // 400 KHz flag is 1<<8
 #endif
+#if defined(ESP32)
+  // The RMT bit timings depend on the speed
+  if (rmtHandle >= 0) {
+    espEnd(rmtHandle);
+    rmtHandle = espBegin(pin, is800KHz);
+  }
+#endif
 
   // If bytes-per-pixel has changed (and pixel data was previously
   // allocated), re-allocate to new size. Will clear any data.
@@ -388,7 +479,7 @@ extern "C" IRAM_ATTR void espShow(uint16_t pin, uint8_t *pixels,
                                   uint32_t numBytes, uint8_t type);
 #elif defined(ESP32)
 extern "C" void espShow(uint16_t pin, uint8_t *pixels, uint32_t numBytes,
-                        uint8_t type);
+                        uint8_t type, const uint8_t *levels);
 #endif // ESP8266
 
 #if defined(K210)
@@ -421,6 +512,12 @@ void Adafruit_NeoPixel::show(void) {
   // subsequent round of data until the latch time has elapsed. This
   // allows the mainline code to start generating the next frame of data
   // rather than stalling for the latch.
+#if defined(ESP32)
+  // A frame from showAsync() may still be going out, block on the RMT
+  // rather than spinning through it
+  if (rmtHandle >= 0)
+    espWait(rmtHandle);
+#endif
   while (!canShow())
     ;
     // endTime is a private member (rather than global var) so that multiple
@@ -3160,7 +3257,19 @@ if(is800KHz) {
   // ESP8266 ----------------------------------------------------------------
 
   // ESP8266 show() is external to enforce ICACHE_RAM_ATTR execution
+#if defined(ESP32)
+  // Nothing is being sent here, the table can change
+  if (levelsDirty)
+    updateLevels();
+  if (rmtHandle >= 0) {
+    // Persistent channel: only the write, then wait so pixels can change
+    espShowAsync(rmtHandle, pixels, numBytes, levels);
+    espWait(rmtHandle);
+  } else
+    espShow(pin, pixels, numBytes, is800KHz, levels);
+#else
   espShow(pin, pixels, numBytes, is800KHz);
+#endif
 
 #elif defined(KENDRYTE_K210)
 
@@ -3278,12 +3387,79 @@ if(is800KHz) {
   endTime = micros(); // Save EOD time for latch on next call
 }
 
+/*!
+  @brief   Start transmitting pixel data and return without waiting for it
+           to finish. On ESP32, for a strip that was begun, the RMT clocks the
+           frame out in the background and canShow() turns true once it has
+           gone out and latched; the pixel data must not be changed before
+           then, unless the strip is double buffered (see
+           setDoubleBuffer()). Elsewhere this is the same as show().
+*/
+void Adafruit_NeoPixel::showAsync(void) {
+#if defined(ESP32)
+  if (pixels && rmtHandle >= 0) {
+    // Block on the RMT while the previous frame goes out, spin only for the
+    // latch
+    espWait(rmtHandle);
+    while (!canShow())
+      ;
+    // The translator reads levels[] while a frame goes out, so it is only
+    // rebuilt between frames
+    if (levelsDirty)
+      updateLevels();
+    if (frontPixels) {
+      // The finished frame becomes the front buffer, drawing carries on in
+      // a copy of it
+      uint8_t *frame = pixels;
+      pixels = frontPixels;
+      frontPixels = frame;
+      memcpy(pixels, frontPixels, numBytes);
+    }
+    espShowAsync(rmtHandle, frontPixels ? frontPixels : pixels, numBytes,
+                 levels);
+    return;
+  }
+#endif
+  show();
+}
+
+/*!
+  @brief   Transmit several strips at once and return when all of them are
+           done. On ESP32 each strip that was begun has its own RMT channel,
+           so all the frames are started before waiting on any, and the
+           time taken is that of the longest strip rather than the sum.
+           Elsewhere the strips are shown one after the other.
+  @param   strips  The strips to show, each on its own pin.
+  @param   n       Number of strips.
+*/
+void Adafruit_NeoPixel::showAll(Adafruit_NeoPixel *const strips[], uint8_t n) {
+  for (uint8_t i = 0; i < n; i++)
+    strips[i]->showAsync();
+#if defined(ESP32)
+  for (uint8_t i = 0; i < n; i++) {
+    if (strips[i]->pixels && strips[i]->rmtHandle >= 0) {
+      espWait(strips[i]->rmtHandle);
+      strips[i]->endTime = micros();
+    }
+  }
+#endif
+}
+
 /*!
   @brief   Set/change the NeoPixel output pin number. Previous pin,
            if any, is set to INPUT and the new pin is set to OUTPUT.
   @param   p  Arduino pin number (-1 = no pin).
 */
 void Adafruit_NeoPixel::setPin(int16_t p) {
+#if defined(ESP32)
+  // Move the strip's RMT channel to the new pin
+  if (rmtHandle >= 0) {
+    espEnd(rmtHandle);
+    rmtHandle = p >= 0 ? espBegin(p, is800KHz) : -1;
+    pin = p;
+    return;
+  }
+#endif
   if (begun && (pin >= 0))
     pinMode(pin, INPUT); // Disable existing out pin
   pin = p;
@@ -3595,8 +3771,20 @@ uint32_t Adafruit_NeoPixel::getPixelColor(uint16_t n) const {
            problem. Smart programs therefore treat the strip as a
            write-only resource, maintaining their own state to render each
            frame of an animation, not relying on read-modify-write.
+           On ESP32 brightness is instead applied as the RMT sends each
+           byte, through a table rebuilt before the next frame, so colors
+           are stored as set and changing brightness is cheap and lossless.
 */
 void Adafruit_NeoPixel::setBrightness(uint8_t b) {
+#if defined(ESP32)
+  // Same +1 encoding as 'brightness', which stays 0 so nothing is scaled
+  // in RAM
+  uint8_t newBrightness = b + 1;
+  if (newBrightness != outputBrightness) {
+    outputBrightness = newBrightness;
+    levelsDirty = true;
+  }
+#else
   // Stored brightness value is different than what's passed.
   // This simplifies the actual scaling math later, allowing a fast
   // 8x8-bit multiply and taking the MSB. 'brightness' is a uint8_t,
@@ -3630,13 +3818,49 @@ void Adafruit_NeoPixel::setBrightness(uint8_t b) {
     }
     brightness = newBrightness;
   }
+#endif
 }
 
 /*!
   @brief   Retrieve the last-set brightness value for the strip.
   @return  Brightness value: 0 = minimum (off), 255 = maximum.
 */
-uint8_t Adafruit_NeoPixel::getBrightness(void) const { return brightness - 1; }
+uint8_t Adafruit_NeoPixel::getBrightness(void) const {
+#if defined(ESP32)
+  return outputBrightness - 1;
+#else
+  return brightness - 1;
+#endif
+}
+
+#if defined(ESP32)
+/*!
+  @brief   Apply gamma8() correction to every byte as it is sent, so colors
+           can be computed in linear space. Takes effect with the next call
+           to show() or showAsync(), stored colors are unchanged.
+  @param   on  true to gamma-correct the output, false to send colors as
+               they are (after brightness).
+*/
+void Adafruit_NeoPixel::setGamma(bool on) {
+  if (on != gammaOn) {
+    gammaOn = on;
+    levelsDirty = true;
+  }
+}
+
+/*!
+  @brief   Rebuild the table the RMT translator looks every byte up in:
+           gamma first, then brightness, so the cost per byte is one load
+           whatever the settings.
+*/
+void Adafruit_NeoPixel::updateLevels(void) {
+  for (uint16_t i = 0; i < 256; i++) {
+    uint8_t c = gammaOn ? gamma8(i) : i;
+    levels[i] = outputBrightness ? (c * outputBrightness) >> 8 : c;
+  }
+  levelsDirty = false;
+}
+#endif
 
 /*!
   @brief   Fill the whole NeoPixel strip with 0 / black / off.
@@ -208,6 +208,16 @@ static const uint8_t PROGMEM _NeoPixelGammaTable[256] = {
     218, 220, 223, 225, 227, 230, 232, 235, 237, 240, 242, 245, 247, 250, 252,
     255};
 
+#if defined(ESP32)
+// RMT channel state kept per strip between begin() and the destructor, esp.c
+extern "C" int espBegin(uint8_t pin, boolean is800KHz);
+extern "C" void espEnd(int handle);
+extern "C" void espShowAsync(int handle, uint8_t *pixels, uint32_t numBytes,
+                             const uint8_t *levels);
+extern "C" bool espCanShow(int handle);
+extern "C" void espWait(int handle);
+#endif
+
 /*!
     @brief  Class that stores state and functions for interacting with
             Adafruit NeoPixels and compatible devices.
@@ -223,12 +233,18 @@ public:
 
   void begin(void);
   void show(void);
+  void showAsync(void);
+  static void showAll(Adafruit_NeoPixel *const strips[], uint8_t n);
+  bool setDoubleBuffer(bool on);
   void setPin(int16_t p);
   void setPixelColor(uint16_t n, uint8_t r, uint8_t g, uint8_t b);
   void setPixelColor(uint16_t n, uint8_t r, uint8_t g, uint8_t b, uint8_t w);
   void setPixelColor(uint16_t n, uint32_t c);
   void fill(uint32_t c = 0, uint16_t first = 0, uint16_t count = 0);
   void setBrightness(uint8_t);
+#if defined(ESP32)
+  void setGamma(bool on);
+#endif
   void clear(void);
   void updateLength(uint16_t n);
   void updateType(neoPixelType t);
@@ -246,6 +262,12 @@ public:
              if show() would block (meaning some idle time is available).
   */
   bool canShow(void) {
+#if defined(ESP32)
+    // A strip that was begun knows from its RMT channel when the last frame
+    // (possibly sent with showAsync()) went out and latched
+    if (rmtHandle >= 0)
+      return espCanShow(rmtHandle);
+#endif
     // It's normal and possible for endTime to exceed micros() if the
     // 32-bit clock counter has rolled over (about every 70 minutes).
     // Since both are uint32_t, a negative delta correctly maps back to
@@ -389,11 +411,20 @@ protected:
   int16_t pin;        ///< Output pin number (-1 if not yet set)
   uint8_t brightness; ///< Strip brightness 0-255 (stored as +1)
   uint8_t *pixels;    ///< Holds LED color values (3 or 4 bytes each)
+  uint8_t *frontPixels; ///< Frame being sent when double buffered, else NULL
   uint8_t rOffset;    ///< Red index within each 3- or 4-byte pixel
   uint8_t gOffset;    ///< Index of green byte
   uint8_t bOffset;    ///< Index of blue byte
   uint8_t wOffset;    ///< Index of white (==rOffset if no white)
   uint32_t endTime;   ///< Latch timing reference
+#if defined(ESP32)
+  int8_t rmtHandle;   ///< RMT channel kept from begin(), -1 if none
+  uint8_t outputBrightness; ///< Like brightness, applied through levels[]
+  bool gammaOn;       ///< gamma8() applied to every byte sent
+  bool levelsDirty;   ///< levels[] to be rebuilt before the next frame
+  uint8_t levels[256]; ///< Byte sent for each stored byte
+  void updateLevels(void);
+#endif
 #ifdef __AVR__
   volatile uint8_t *port; ///< Output PORT register
   uint8_t pinMask;        ///< Output PORT bitmask
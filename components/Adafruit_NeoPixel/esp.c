@@ -30,65 +30,240 @@
 #endif
 #endif
 
+#include "esp_timer.h"
+
+// Persistent strips, see Adafruit_NeoPixel::begin(). A handle identifies the
+// strip's RMT channel from espBegin() until espEnd()
+int espBegin(uint8_t pin, boolean is800KHz);
+void espEnd(int handle);
+void espShowAsync(int handle, uint8_t *pixels, uint32_t numBytes, const uint8_t *levels);
+bool espCanShow(int handle);
+void espWait(int handle);
+
+// The finish times below are 64 bit, written by the RMT interrupt and read by
+// the task, possibly on the other core. Xtensa loads them in two halves, so
+// every access takes this lock
+static portMUX_TYPE txEndLock = portMUX_INITIALIZER_UNLOCKED;
+
+// While a frame is sending its finish time is a deadline: a frame whose end is
+// never reported counts as finished then, so waiting on canShow() can't hang.
+// A byte takes at most 20 microseconds (400 kHz), plus room for a late interrupt
+#define ADAFRUIT_RMT_TIMEOUT_US(numBytes) ((int64_t)(numBytes) * 20 + 100000)
 
+#define WS2812_T0H_NS (400)
+#define WS2812_T0L_NS (850)
+#define WS2812_T1H_NS (800)
+#define WS2812_T1L_NS (450)
+
+#define WS2811_T0H_NS (500)
+#define WS2811_T0L_NS (2000)
+#define WS2811_T1H_NS (1200)
+#define WS2811_T1L_NS (1300)
 
 #ifdef HAS_ESP_IDF_5
 
-void espShow(uint8_t pin, uint8_t *pixels, uint32_t numBytes, boolean is800KHz) {
-  rmt_data_t led_data[numBytes * 8];
+#include "driver/rmt_tx.h"
+#include "driver/rmt_encoder.h"
+
+// Strips set up by espBegin(), each keeps its RMT channel and encoder until
+// espEnd()
+#define ADAFRUIT_RMT_STRIPS_MAX 8
+// Pixel bytes looked up in the levels table and handed to the bytes encoder at
+// a time, so encoding takes the same memory whatever the strip length
+#define ADAFRUIT_RMT_CHUNK 32
+#define ADAFRUIT_RMT_RESOLUTION_HZ 10000000
+#define NS_TO_TICKS(ns) ((ns) / (1000000000 / ADAFRUIT_RMT_RESOLUTION_HZ))
+
+// Streams a frame: the pixel bytes go through the levels table a chunk at a
+// time, the bytes encoder turns each chunk into bit symbols as the RMT memory
+// frees up
+typedef struct {
+  rmt_encoder_t base;
+  rmt_encoder_t *bytes;
+  const uint8_t *levels; // for the frame being sent
+  size_t done;           // pixel bytes encoded so far
+  size_t chunkLen;       // bytes in chunk[] still being encoded, 0 for none
+  uint8_t chunk[ADAFRUIT_RMT_CHUNK];
+} espEncoder;
+
+typedef struct {
+  bool used;
+  rmt_channel_handle_t channel;
+  espEncoder *encoder;
+  int64_t doneUs; // when the last frame finished, its deadline while sending, under txEndLock
+} espStrip;
+
+static espStrip strips[ADAFRUIT_RMT_STRIPS_MAX];
+
+static size_t IRAM_ATTR espEncode(rmt_encoder_t *encoder, rmt_channel_handle_t channel,
+        const void *primary_data, size_t data_size, rmt_encode_state_t *ret_state) {
+  espEncoder *enc = __containerof(encoder, espEncoder, base);
+  const uint8_t *pixels = (const uint8_t *)primary_data;
+  size_t encoded = 0;
+  while (enc->done < data_size) {
+    if (enc->chunkLen == 0) {
+      // the chunk must stay as it is until the bytes encoder has finished it
+      enc->chunkLen = data_size - enc->done < ADAFRUIT_RMT_CHUNK ? data_size - enc->done : ADAFRUIT_RMT_CHUNK;
+      for (size_t i = 0; i < enc->chunkLen; i++) {
+        enc->chunk[i] = enc->levels[pixels[enc->done + i]];
+      }
+    }
+    rmt_encode_state_t state = RMT_ENCODING_RESET;
+    encoded += enc->bytes->encode(enc->bytes, channel, enc->chunk, enc->chunkLen, &state);
+    if (state & RMT_ENCODING_COMPLETE) {
+      enc->done += enc->chunkLen;
+      enc->chunkLen = 0;
+    }
+    if (state & RMT_ENCODING_MEM_FULL) {
+      // called again, with the same frame, once the RMT has room
+      *ret_state = RMT_ENCODING_MEM_FULL;
+      return encoded;
+    }
+  }
+  enc->done = 0;
+  *ret_state = RMT_ENCODING_COMPLETE;
+  return encoded;
+}
+
+static esp_err_t espEncoderReset(rmt_encoder_t *encoder) {
+  espEncoder *enc = __containerof(encoder, espEncoder, base);
+  enc->done = 0;
+  enc->chunkLen = 0;
+  return rmt_encoder_reset(enc->bytes);
+}
+
+static esp_err_t espEncoderDel(rmt_encoder_t *encoder) {
+  espEncoder *enc = __containerof(encoder, espEncoder, base);
+  rmt_del_encoder(enc->bytes);
+  free(enc);
+  return ESP_OK;
+}
+
+static bool IRAM_ATTR espTxDone(rmt_channel_handle_t channel, const rmt_tx_done_event_data_t *edata, void *ctx) {
+  int64_t now = esp_timer_get_time();
+  portENTER_CRITICAL_ISR(&txEndLock);
+  ((espStrip *)ctx)->doneUs = now;
+  portEXIT_CRITICAL_ISR(&txEndLock);
+  return false;
+}
 
-  if (!rmtInit(pin, RMT_TX_MODE, RMT_MEM_NUM_BLOCKS_1, 10000000)) {
+int espBegin(uint8_t pin, boolean is800KHz) {
+  int handle = -1;
+  for (int i = 0; i < ADAFRUIT_RMT_STRIPS_MAX; i++) {
+    if (!strips[i].used) {
+      handle = i;
+      break;
+    }
+  }
+  if (handle < 0) {
+    return -1;
+  }
+  espStrip *strip = &strips[handle];
+
+  rmt_tx_channel_config_t config = {
+    .gpio_num = pin,
+    .clk_src = RMT_CLK_SRC_DEFAULT,
+    .resolution_hz = ADAFRUIT_RMT_RESOLUTION_HZ,
+    .mem_block_symbols = 64,
+    .trans_queue_depth = 1,
+  };
+  if (rmt_new_tx_channel(&config, &strip->channel) != ESP_OK) {
     log_e("Failed to init RMT TX mode on pin %d", pin);
-    return;
+    return -1;
   }
 
-  int i=0;
-  for (int b=0; b < numBytes; b++) {
-    for (int bit=0; bit<8; bit++){
-      if ( pixels[b] & (1<<(7-bit)) ) {
-        led_data[i].level0 = 1;
-        led_data[i].duration0 = 8;
-        led_data[i].level1 = 0;
-        led_data[i].duration1 = 4;
-      } else {
-        led_data[i].level0 = 1;
-        led_data[i].duration0 = 4;
-        led_data[i].level1 = 0;
-        led_data[i].duration1 = 8;
-      }
-      i++;
-    }
+  rmt_bytes_encoder_config_t bytesConfig = {
+    .bit0 = {
+      .duration0 = NS_TO_TICKS(is800KHz ? WS2812_T0H_NS : WS2811_T0H_NS), .level0 = 1,
+      .duration1 = NS_TO_TICKS(is800KHz ? WS2812_T0L_NS : WS2811_T0L_NS), .level1 = 0,
+    },
+    .bit1 = {
+      .duration0 = NS_TO_TICKS(is800KHz ? WS2812_T1H_NS : WS2811_T1H_NS), .level0 = 1,
+      .duration1 = NS_TO_TICKS(is800KHz ? WS2812_T1L_NS : WS2811_T1L_NS), .level1 = 0,
+    },
+    .flags.msb_first = 1,
+  };
+  strip->encoder = (espEncoder *)calloc(1, sizeof(espEncoder));
+  if (!strip->encoder || rmt_new_bytes_encoder(&bytesConfig, &strip->encoder->bytes) != ESP_OK) {
+    free(strip->encoder);
+    rmt_del_channel(strip->channel);
+    return -1;
   }
+  strip->encoder->base.encode = espEncode;
+  strip->encoder->base.reset = espEncoderReset;
+  strip->encoder->base.del = espEncoderDel;
+
+  rmt_tx_event_callbacks_t callbacks = {.on_trans_done = espTxDone};
+  rmt_tx_register_event_callbacks(strip->channel, &callbacks, strip);
+  rmt_enable(strip->channel);
+  strip->doneUs = 0;
+  strip->used = true;
+  return handle;
+}
 
-  //pinMode(pin, OUTPUT);  // don't do this, will cause the rmt to disable!
-  rmtWrite(pin, led_data, numBytes * 8, RMT_WAIT_FOR_EVER);
+void espEnd(int handle) {
+  espStrip *strip = &strips[handle];
+  espWait(handle);
+  rmt_disable(strip->channel);
+  rmt_del_channel(strip->channel);
+  rmt_del_encoder(&strip->encoder->base);
+  strip->used = false;
 }
 
+void espShowAsync(int handle, uint8_t *pixels, uint32_t numBytes, const uint8_t *levels) {
+  // The encoder reads pixels and levels from the RMT interrupt, they must not
+  // change until espCanShow()
+  espStrip *strip = &strips[handle];
+  rmt_transmit_config_t config = {.loop_count = 0};
+  strip->encoder->levels = levels;
+  int64_t deadline = esp_timer_get_time() + ADAFRUIT_RMT_TIMEOUT_US(numBytes);
+  portENTER_CRITICAL(&txEndLock);
+  strip->doneUs = deadline;
+  portEXIT_CRITICAL(&txEndLock);
+  if (rmt_transmit(strip->channel, &strip->encoder->base, pixels, numBytes, &config) != ESP_OK) {
+    // nothing is sent, so no callback will come to end the frame
+    int64_t now = esp_timer_get_time();
+    portENTER_CRITICAL(&txEndLock);
+    strip->doneUs = now;
+    portEXIT_CRITICAL(&txEndLock);
+  }
+}
+
+bool espCanShow(int handle) {
+  portENTER_CRITICAL(&txEndLock);
+  int64_t doneUs = strips[handle].doneUs;
+  portEXIT_CRITICAL(&txEndLock);
+  // the pixels latch after 300 microseconds without data
+  return esp_timer_get_time() - doneUs >= 300;
+}
 
+void espWait(int handle) {
+  // Block until the frame is out. The done callback may not have run yet,
+  // so a finish time still at the deadline is brought in to now
+  espStrip *strip = &strips[handle];
+  if (rmt_tx_wait_all_done(strip->channel, 100) == ESP_OK) {
+    int64_t now = esp_timer_get_time();
+    portENTER_CRITICAL(&txEndLock);
+    if (strip->doneUs > now)
+      strip->doneUs = now;
+    portEXIT_CRITICAL(&txEndLock);
+  }
+}
+
+#undef NS_TO_TICKS
 
 #else
 
 #include "driver/rmt.h"
 
+#if ESP_IDF_VERSION >= ESP_IDF_VERSION_VAL(4, 3, 0)
+#define HAS_RMT_TRANSLATOR_CONTEXT
+#endif
+
 
 // This code is adapted from the ESP-IDF v3.4 RMT "led_strip" example, altered
 // to work with the Arduino version of the ESP-IDF (3.2)
 
-#define WS2812_T0H_NS (400)
-#define WS2812_T0L_NS (850)
-#define WS2812_T1H_NS (800)
-#define WS2812_T1L_NS (450)
-
-#define WS2811_T0H_NS (500)
-#define WS2811_T0L_NS (2000)
-#define WS2811_T1H_NS (1200)
-#define WS2811_T1L_NS (1300)
-
-static uint32_t t0h_ticks = 0;
-static uint32_t t1h_ticks = 0;
-static uint32_t t0l_ticks = 0;
-static uint32_t t1l_ticks = 0;
-
 // Limit the number of RMT channels available for the Neopixels. Defaults to all
 // channels (8 on ESP32, 4 on ESP32-S2 and S3). Redefining this value will free
 // any channels with a higher number for other uses, such as IR send-and-recieve
@@ -99,6 +274,24 @@ static uint32_t t1l_ticks = 0;
 
 bool rmt_reserved_channels[ADAFRUIT_RMT_CHANNEL_MAX];
 
+// A strip set up by espBegin() keeps its channel, driver and translator until
+// espEnd(), so a frame only costs the write itself
+typedef struct {
+  uint8_t pin;
+  rmt_item32_t bits[2]; // logical 0 and 1 in ticks of this channel's clock
+  const uint8_t *levels; // byte sent for each pixel byte, for the frame being sent
+  int64_t txEndUs; // when the last frame finished, its deadline while sending, under txEndLock
+} espStrip;
+
+static espStrip strips[ADAFRUIT_RMT_CHANNEL_MAX];
+static bool txEndRegistered = false;
+
+#ifndef HAS_RMT_TRANSLATOR_CONTEXT
+// without a translator context all strips share the timings and levels of the
+// last one begun
+static espStrip *sharedStrip;
+#endif
+
 static void IRAM_ATTR ws2812_rmt_adapter(const void *src, rmt_item32_t *dest, size_t src_size,
         size_t wanted_num, size_t *translated_size, size_t *item_num)
 {
@@ -107,16 +300,25 @@ static void IRAM_ATTR ws2812_rmt_adapter(const void *src, rmt_item32_t *dest, si
         *item_num = 0;
         return;
     }
-    const rmt_item32_t bit0 = {{{ t0h_ticks, 1, t0l_ticks, 0 }}}; //Logical 0
-    const rmt_item32_t bit1 = {{{ t1h_ticks, 1, t1l_ticks, 0 }}}; //Logical 1
+#ifdef HAS_RMT_TRANSLATOR_CONTEXT
+    espStrip *strip = NULL;
+    rmt_translator_get_context(item_num, (void **)&strip);
+#else
+    espStrip *strip = sharedStrip;
+#endif
+    const rmt_item32_t bit0 = strip->bits[0]; //Logical 0
+    const rmt_item32_t bit1 = strip->bits[1]; //Logical 1
+    // brightness and gamma, one lookup per byte
+    const uint8_t *levels = strip->levels;
     size_t size = 0;
     size_t num = 0;
     uint8_t *psrc = (uint8_t *)src;
     rmt_item32_t *pdest = dest;
     while (size < src_size && num < wanted_num) {
+        uint8_t byte = levels[*psrc];
         for (int i = 0; i < 8; i++) {
             // MSB first
-            if (*psrc & (1 << (7 - i))) {
+            if (byte & (1 << (7 - i))) {
                 pdest->val =  bit1.val;
             } else {
                 pdest->val =  bit0.val;
@@ -131,7 +333,17 @@ static void IRAM_ATTR ws2812_rmt_adapter(const void *src, rmt_item32_t *dest, si
     *item_num = num;
 }
 
-void espShow(uint8_t pin, uint8_t *pixels, uint32_t numBytes, boolean is800KHz) {
+static void IRAM_ATTR espTxEnd(rmt_channel_t channel, void *arg)
+{
+    if (channel < ADAFRUIT_RMT_CHANNEL_MAX) {
+        int64_t now = esp_timer_get_time();
+        portENTER_CRITICAL_ISR(&txEndLock);
+        strips[channel].txEndUs = now;
+        portEXIT_CRITICAL_ISR(&txEndLock);
+    }
+}
+
+int espBegin(uint8_t pin, boolean is800KHz) {
     // Reserve channel
     rmt_channel_t channel = ADAFRUIT_RMT_CHANNEL_MAX;
     for (size_t i = 0; i < ADAFRUIT_RMT_CHANNEL_MAX; i++) {
@@ -143,7 +355,7 @@ void espShow(uint8_t pin, uint8_t *pixels, uint32_t numBytes, boolean is800KHz)
     }
     if (channel == ADAFRUIT_RMT_CHANNEL_MAX) {
         // Ran out of channels!
-        return;
+        return -1;
     }
 
 #if defined(HAS_ESP_IDF_4)
@@ -189,36 +401,92 @@ void espShow(uint8_t pin, uint8_t *pixels, uint32_t numBytes, boolean is800KHz)
     }
 #endif
 
-    // NS to tick converter
-    float ratio = (float)counter_clk_hz / 1e9;
-
+    // NS to tick converter, once per strip rather than per frame
+#define NS_TO_TICKS(ns) ((uint32_t)((uint64_t)counter_clk_hz * (ns) / 1000000000))
+    espStrip *strip = &strips[channel];
+    strip->pin = pin;
     if (is800KHz) {
-        t0h_ticks = (uint32_t)(ratio * WS2812_T0H_NS);
-        t0l_ticks = (uint32_t)(ratio * WS2812_T0L_NS);
-        t1h_ticks = (uint32_t)(ratio * WS2812_T1H_NS);
-        t1l_ticks = (uint32_t)(ratio * WS2812_T1L_NS);
+        strip->bits[0] = (rmt_item32_t){{{ NS_TO_TICKS(WS2812_T0H_NS), 1, NS_TO_TICKS(WS2812_T0L_NS), 0 }}};
+        strip->bits[1] = (rmt_item32_t){{{ NS_TO_TICKS(WS2812_T1H_NS), 1, NS_TO_TICKS(WS2812_T1L_NS), 0 }}};
     } else {
-        t0h_ticks = (uint32_t)(ratio * WS2811_T0H_NS);
-        t0l_ticks = (uint32_t)(ratio * WS2811_T0L_NS);
-        t1h_ticks = (uint32_t)(ratio * WS2811_T1H_NS);
-        t1l_ticks = (uint32_t)(ratio * WS2811_T1L_NS);
+        strip->bits[0] = (rmt_item32_t){{{ NS_TO_TICKS(WS2811_T0H_NS), 1, NS_TO_TICKS(WS2811_T0L_NS), 0 }}};
+        strip->bits[1] = (rmt_item32_t){{{ NS_TO_TICKS(WS2811_T1H_NS), 1, NS_TO_TICKS(WS2811_T1L_NS), 0 }}};
     }
+#undef NS_TO_TICKS
+    strip->txEndUs = 0;
 
     // Initialize automatic timing translator
     rmt_translator_init(config.channel, ws2812_rmt_adapter);
+#ifdef HAS_RMT_TRANSLATOR_CONTEXT
+    rmt_translator_set_context(config.channel, strip);
+#else
+    sharedStrip = strip;
+#endif
+    if (!txEndRegistered) {
+        rmt_register_tx_end_callback(espTxEnd, NULL);
+        txEndRegistered = true;
+    }
+    return channel;
+}
 
-    // Write and wait to finish
-    rmt_write_sample(config.channel, pixels, (size_t)numBytes, true);
-    rmt_wait_tx_done(config.channel, pdMS_TO_TICKS(100));
-
+void espEnd(int handle) {
+    espWait(handle);
     // Free channel again
-    rmt_driver_uninstall(config.channel);
-    rmt_reserved_channels[channel] = false;
+    rmt_driver_uninstall((rmt_channel_t)handle);
+    rmt_reserved_channels[handle] = false;
+
+    gpio_set_direction(strips[handle].pin, GPIO_MODE_OUTPUT);
+}
+
+void espShowAsync(int handle, uint8_t *pixels, uint32_t numBytes, const uint8_t *levels) {
+    // Start the write; the driver translates the rest from its interrupt, so
+    // pixels and levels must not change until espCanShow()
+    strips[handle].levels = levels;
+    int64_t deadline = esp_timer_get_time() + ADAFRUIT_RMT_TIMEOUT_US(numBytes);
+    portENTER_CRITICAL(&txEndLock);
+    strips[handle].txEndUs = deadline;
+    portEXIT_CRITICAL(&txEndLock);
+    if (rmt_write_sample((rmt_channel_t)handle, pixels, (size_t)numBytes, false) != ESP_OK) {
+        // nothing is sent, so no tx end callback will come to end the frame
+        int64_t now = esp_timer_get_time();
+        portENTER_CRITICAL(&txEndLock);
+        strips[handle].txEndUs = now;
+        portEXIT_CRITICAL(&txEndLock);
+    }
+}
 
-    gpio_set_direction(pin, GPIO_MODE_OUTPUT);
+bool espCanShow(int handle) {
+    portENTER_CRITICAL(&txEndLock);
+    int64_t txEndUs = strips[handle].txEndUs;
+    portEXIT_CRITICAL(&txEndLock);
+    // the pixels latch after 300 microseconds without data
+    return esp_timer_get_time() - txEndUs >= 300;
+}
+
+void espWait(int handle) {
+    // Block until the frame is out. The tx end callback may not have run yet,
+    // so a finish time still at the deadline is brought in to now
+    if (rmt_wait_tx_done((rmt_channel_t)handle, pdMS_TO_TICKS(100)) == ESP_OK) {
+        int64_t now = esp_timer_get_time();
+        portENTER_CRITICAL(&txEndLock);
+        if (strips[handle].txEndUs > now)
+            strips[handle].txEndUs = now;
+        portEXIT_CRITICAL(&txEndLock);
+    }
 }
 
 #endif // ifndef IDF5
+
+// One-shot show for strips that were never begun: set up, send, tear down
+void espShow(uint8_t pin, uint8_t *pixels, uint32_t numBytes, boolean is800KHz, const uint8_t *levels) {
+  int handle = espBegin(pin, is800KHz);
+  if (handle < 0) {
+    return;
+  }
+  espShowAsync(handle, pixels, numBytes, levels);
+  espWait(handle);
+  espEnd(handle);
+}
  
 
 #endif // ifdef(ESP32)
@@ -25,6 +25,8 @@
 #include "reciter.h"
 #include "sam.h"
 #include "SamData.h"
+#include "mem_telemetry.h"
+#include "trace.h"
 
 #ifndef ESP8266
 static void yield() { /* NOOP */ }
@@ -51,8 +53,47 @@ void ESP8266SAM::OutputByte(unsigned char b)
   while (!output_cb((void*)(0), sample)) yield();
 }
 
+// Input massaging shared by Say and Phonemize
+static void UpperInput(const char *str, char *input)
+{
+  for (int i=0; str[i]; i++)
+    input[i] = toupper((int)str[i]);
+  input[strlen(str)] = 0;
+}
+
+bool ESP8266SAM::Phonemize(const char *str, char *out, size_t len)
+{
+  if (!str || strlen(str)>254 || len == 0) return false;
+  samdata = new SamData;
+  if (samdata == nullptr)
+  {
+      // allocation failed!
+      return false;
+  }
+  mem_telemetry_alloc(MEM_SAM, sizeof(SamData));
+
+  char input[256];
+  UpperInput(str, input);
+  strncat(input, "[", 255);
+  bool ok = TextToPhonemes(input);
+  if (ok) {
+    // the phonemes end with the 0x9b end of line marker, Say adds it back
+    size_t n = 0;
+    while (n < 255 && (unsigned char)input[n] != 0x9b && input[n]) n++;
+    ok = n < len;
+    if (ok) {
+      memcpy(out, input, n);
+      out[n] = 0;
+    }
+  }
+  delete samdata;
+  mem_telemetry_free(MEM_SAM, sizeof(SamData));
+  return ok;
+}
+
 bool ESP8266SAM::Say(const char *str)
 {
+  TraceScope trace("Say");
   if (!str || strlen(str)>254) return false; // Only can speak up to 1 page worth of data...
   samdata = new SamData;
   if (samdata == nullptr)
@@ -60,6 +101,7 @@ bool ESP8266SAM::Say(const char *str)
       // allocation failed!
       return false;
   }
+  mem_telemetry_alloc(MEM_SAM, sizeof(SamData));
 
   // SAM settings
   EnableSingmode(singmode);
@@ -70,22 +112,26 @@ bool ESP8266SAM::Say(const char *str)
 
   // Input massaging
   char input[256];
-  for (int i=0; str[i]; i++)
-    input[i] = toupper((int)str[i]);
-  input[strlen(str)] = 0;
+  UpperInput(str, input);
 
   // To phonemes
   if (phonetic) {
     strncat(input, "\x9b", 255);
   } else {
     strncat(input, "[", 255);
-    if (!TextToPhonemes(input)) return false; // ERROR
+    if (!TextToPhonemes(input)) {
+      // ERROR, don't leak the SamData
+      delete samdata;
+      mem_telemetry_free(MEM_SAM, sizeof(SamData));
+      return false;
+    }
   }
 
   // Say it!
   SetInput(input);
   SAMMain(OutputByteCallback, (void*)this);
   delete samdata;
+  mem_telemetry_free(MEM_SAM, sizeof(SamData));
   return true;
 }
 
@@ -46,6 +46,9 @@ public:
   void SetSpeed(uint8_t val) { speed = val; }
 
   bool Say(const char *str);
+  // Convert text to the phoneme string Say() accepts with SetPhonetic(true), so the
+  // conversion can run ahead of time. Neither call is reentrant: they share SAM's globals
+  bool Phonemize(const char *str, char *out, size_t len);
   bool(*output_cb)(void *cbdata, int16_t* b);
 
 private:
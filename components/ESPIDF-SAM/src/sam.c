@@ -7,6 +7,7 @@
 #include "render.h"
 #include "SamTabs.h"
 #include "SamData.h"
+#include "trace.h"
 
 //standard sam sound
 unsigned char speed = 72;
@@ -219,7 +220,9 @@ void PrepareOutput()
 		{
 			A = 255;
 			phonemeIndexOutput[Y] = 255;
+			int64_t trace_start_us = trace_begin();
 			Render();
+			trace_end("Render", trace_start_us);
 			return;
 		}
 		if (A == 254)
@@ -228,7 +231,9 @@ void PrepareOutput()
 			int temp = X;
 			//mem[48546] = X;
 			phonemeIndexOutput[Y] = 255;
+			int64_t trace_start_us = trace_begin();
 			Render();
+			trace_end("Render", trace_start_us);
 			//X = mem[48546];
 			X=temp;
 			Y = 0;
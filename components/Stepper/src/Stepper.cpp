@@ -77,6 +77,32 @@
 
 #include "Arduino.h"
 #include "Stepper.h"
+#include <math.h>
+#if defined(ESP_PLATFORM)
+#include "soc/soc.h"
+#include "soc/gpio_reg.h"
+#endif
+
+/*
+ * Coil patterns for each phase, from the tables at the top of the file.
+ * Bit i drives motor pin i + 1.
+ */
+static const uint8_t phases_2pin[4] = {
+  0x02 /* 01 */, 0x03 /* 11 */, 0x01 /* 10 */, 0x00 /* 00 */
+};
+static const uint8_t phases_4pin[4] = {
+  0x05 /* 1010 */, 0x06 /* 0110 */, 0x0a /* 0101 */, 0x09 /* 1001 */
+};
+// half steps: a single coil between each pair of the full steps above
+static const uint8_t phases_4pin_half[8] = {
+  0x05 /* 1010 */, 0x04 /* 0010 */, 0x06 /* 0110 */, 0x02 /* 0100 */,
+  0x0a /* 0101 */, 0x08 /* 0001 */, 0x09 /* 1001 */, 0x01 /* 1000 */
+};
+static const uint8_t phases_5pin[10] = {
+  0x16 /* 01101 */, 0x12 /* 01001 */, 0x1a /* 01011 */, 0x0a /* 01010 */,
+  0x0b /* 11010 */, 0x09 /* 10010 */, 0x0d /* 10110 */, 0x05 /* 10100 */,
+  0x15 /* 10101 */, 0x14 /* 00101 */
+};
 
 /*
  * two-wire constructor.
@@ -88,6 +114,10 @@ Stepper::Stepper(int number_of_steps, int motor_pin_1, int motor_pin_2)
   this->direction = 0;      // motor direction
   this->last_step_time = 0; // timestamp in us of the last step taken
   this->number_of_steps = number_of_steps; // total number of steps for this motor
+  this->position = 0;
+#if defined(ESP_PLATFORM)
+  initAsync();
+#endif
 
   // Arduino pins for the motor control connection:
   this->motor_pin_1 = motor_pin_1;
@@ -104,6 +134,8 @@ Stepper::Stepper(int number_of_steps, int motor_pin_1, int motor_pin_2)
 
   // pin_count is used by the stepMotor() method:
   this->pin_count = 2;
+  this->half_step = false;
+  initPhases();
 }
 
 
@@ -118,6 +150,10 @@ Stepper::Stepper(int number_of_steps, int motor_pin_1, int motor_pin_2,
   this->direction = 0;      // motor direction
   this->last_step_time = 0; // timestamp in us of the last step taken
   this->number_of_steps = number_of_steps; // total number of steps for this motor
+  this->position = 0;
+#if defined(ESP_PLATFORM)
+  initAsync();
+#endif
 
   // Arduino pins for the motor control connection:
   this->motor_pin_1 = motor_pin_1;
@@ -136,6 +172,8 @@ Stepper::Stepper(int number_of_steps, int motor_pin_1, int motor_pin_2,
 
   // pin_count is used by the stepMotor() method:
   this->pin_count = 4;
+  this->half_step = false;
+  initPhases();
 }
 
 /*
@@ -150,6 +188,10 @@ Stepper::Stepper(int number_of_steps, int motor_pin_1, int motor_pin_2,
   this->direction = 0;      // motor direction
   this->last_step_time = 0; // timestamp in us of the last step taken
   this->number_of_steps = number_of_steps; // total number of steps for this motor
+  this->position = 0;
+#if defined(ESP_PLATFORM)
+  initAsync();
+#endif
 
   // Arduino pins for the motor control connection:
   this->motor_pin_1 = motor_pin_1;
@@ -167,6 +209,8 @@ Stepper::Stepper(int number_of_steps, int motor_pin_1, int motor_pin_2,
 
   // pin_count is used by the stepMotor() method:
   this->pin_count = 5;
+  this->half_step = false;
+  initPhases();
 }
 
 /*
@@ -179,11 +223,19 @@ void Stepper::setSpeed(long whatSpeed)
 
 /*
  * Moves the motor steps_to_move steps.  If the number is negative,
- * the motor moves in the reverse direction.
+ * the motor moves in the reverse direction. On ESP32 it does nothing while
+ * an asynchronous move is running or queued.
  */
 void Stepper::step(int steps_to_move)
 {
   int steps_left = abs(steps_to_move);  // how many steps to take
+#if defined(ESP_PLATFORM)
+  // the timer would step against this loop, and aim for where it thinks the
+  // motor is
+  if (this->busy) {
+    return;
+  }
+#endif
 
   // determine direction based on whether steps_to_mode is + or -:
   if (steps_to_move > 0) { this->direction = 1; }
@@ -199,162 +251,332 @@ void Stepper::step(int steps_to_move)
     {
       // get the timeStamp of when you stepped:
       this->last_step_time = now;
-      // increment or decrement the step number,
-      // depending on direction:
-      if (this->direction == 1)
-      {
-        this->step_number++;
-        if (this->step_number == this->number_of_steps) {
-          this->step_number = 0;
-        }
-      }
-      else
-      {
-        if (this->step_number == 0) {
-          this->step_number = this->number_of_steps;
-        }
-        this->step_number--;
-      }
       // decrement the steps left:
       steps_left--;
-      // step the motor to step number 0, 1, ..., {3 or 10}
-      if (this->pin_count == 5)
-        stepMotor(this->step_number % 10);
-      else
-        stepMotor(this->step_number % 4);
+      stepOnce(this->direction);
     } else {
       delay(10);
     }
   }
+#if defined(ESP_PLATFORM)
+  // the next asynchronous move starts from here, not from where the last one
+  // ended
+  portENTER_CRITICAL(&this->lock);
+  this->move_start = this->move_target = this->queued_target = this->position;
+  portEXIT_CRITICAL(&this->lock);
+#endif
 }
 
 /*
- * Moves the motor forward or backwards.
+ * Takes one step in the given direction (1 forward, 0 back) and keeps
+ * track of the position.
  */
-void Stepper::stepMotor(int thisStep)
+void Stepper::stepOnce(int direction)
 {
-  if (this->pin_count == 2) {
-    switch (thisStep) {
-      case 0:  // 01
-        digitalWrite(motor_pin_1, LOW);
-        digitalWrite(motor_pin_2, HIGH);
-      break;
-      case 1:  // 11
-        digitalWrite(motor_pin_1, HIGH);
-        digitalWrite(motor_pin_2, HIGH);
-      break;
-      case 2:  // 10
-        digitalWrite(motor_pin_1, HIGH);
-        digitalWrite(motor_pin_2, LOW);
-      break;
-      case 3:  // 00
-        digitalWrite(motor_pin_1, LOW);
-        digitalWrite(motor_pin_2, LOW);
-      break;
+  // increment or decrement the step number,
+  // depending on direction:
+  if (direction == 1)
+  {
+    this->step_number++;
+    if (this->step_number == this->number_of_steps) {
+      this->step_number = 0;
     }
+    this->position++;
   }
-  if (this->pin_count == 4) {
-    switch (thisStep) {
-      case 0:  // 1010
-        digitalWrite(motor_pin_1, HIGH);
-        digitalWrite(motor_pin_2, LOW);
-        digitalWrite(motor_pin_3, HIGH);
-        digitalWrite(motor_pin_4, LOW);
-      break;
-      case 1:  // 0110
-        digitalWrite(motor_pin_1, LOW);
-        digitalWrite(motor_pin_2, HIGH);
-        digitalWrite(motor_pin_3, HIGH);
-        digitalWrite(motor_pin_4, LOW);
-      break;
-      case 2:  //0101
-        digitalWrite(motor_pin_1, LOW);
-        digitalWrite(motor_pin_2, HIGH);
-        digitalWrite(motor_pin_3, LOW);
-        digitalWrite(motor_pin_4, HIGH);
-      break;
-      case 3:  //1001
-        digitalWrite(motor_pin_1, HIGH);
-        digitalWrite(motor_pin_2, LOW);
-        digitalWrite(motor_pin_3, LOW);
-        digitalWrite(motor_pin_4, HIGH);
-      break;
+  else
+  {
+    if (this->step_number == 0) {
+      this->step_number = this->number_of_steps;
     }
+    this->step_number--;
+    this->position--;
   }
+  // step the motor to step number 0, 1, ..., {3, 7 or 9}
+  stepMotor(this->step_number % this->phase_count);
+}
 
+/*
+ * Picks the phase table for the wiring and, on ESP32, precomputes the GPIO
+ * set and clear masks of every phase.
+ */
+void Stepper::initPhases(void)
+{
   if (this->pin_count == 5) {
-    switch (thisStep) {
-      case 0:  // 01101
-        digitalWrite(motor_pin_1, LOW);
-        digitalWrite(motor_pin_2, HIGH);
-        digitalWrite(motor_pin_3, HIGH);
-        digitalWrite(motor_pin_4, LOW);
-        digitalWrite(motor_pin_5, HIGH);
-        break;
-      case 1:  // 01001
-        digitalWrite(motor_pin_1, LOW);
-        digitalWrite(motor_pin_2, HIGH);
-        digitalWrite(motor_pin_3, LOW);
-        digitalWrite(motor_pin_4, LOW);
-        digitalWrite(motor_pin_5, HIGH);
-        break;
-      case 2:  // 01011
-        digitalWrite(motor_pin_1, LOW);
-        digitalWrite(motor_pin_2, HIGH);
-        digitalWrite(motor_pin_3, LOW);
-        digitalWrite(motor_pin_4, HIGH);
-        digitalWrite(motor_pin_5, HIGH);
-        break;
-      case 3:  // 01010
-        digitalWrite(motor_pin_1, LOW);
-        digitalWrite(motor_pin_2, HIGH);
-        digitalWrite(motor_pin_3, LOW);
-        digitalWrite(motor_pin_4, HIGH);
-        digitalWrite(motor_pin_5, LOW);
-        break;
-      case 4:  // 11010
-        digitalWrite(motor_pin_1, HIGH);
-        digitalWrite(motor_pin_2, HIGH);
-        digitalWrite(motor_pin_3, LOW);
-        digitalWrite(motor_pin_4, HIGH);
-        digitalWrite(motor_pin_5, LOW);
-        break;
-      case 5:  // 10010
-        digitalWrite(motor_pin_1, HIGH);
-        digitalWrite(motor_pin_2, LOW);
-        digitalWrite(motor_pin_3, LOW);
-        digitalWrite(motor_pin_4, HIGH);
-        digitalWrite(motor_pin_5, LOW);
-        break;
-      case 6:  // 10110
-        digitalWrite(motor_pin_1, HIGH);
-        digitalWrite(motor_pin_2, LOW);
-        digitalWrite(motor_pin_3, HIGH);
-        digitalWrite(motor_pin_4, HIGH);
-        digitalWrite(motor_pin_5, LOW);
-        break;
-      case 7:  // 10100
-        digitalWrite(motor_pin_1, HIGH);
-        digitalWrite(motor_pin_2, LOW);
-        digitalWrite(motor_pin_3, HIGH);
-        digitalWrite(motor_pin_4, LOW);
-        digitalWrite(motor_pin_5, LOW);
-        break;
-      case 8:  // 10101
-        digitalWrite(motor_pin_1, HIGH);
-        digitalWrite(motor_pin_2, LOW);
-        digitalWrite(motor_pin_3, HIGH);
-        digitalWrite(motor_pin_4, LOW);
-        digitalWrite(motor_pin_5, HIGH);
-        break;
-      case 9:  // 00101
-        digitalWrite(motor_pin_1, LOW);
-        digitalWrite(motor_pin_2, LOW);
-        digitalWrite(motor_pin_3, HIGH);
-        digitalWrite(motor_pin_4, LOW);
-        digitalWrite(motor_pin_5, HIGH);
-        break;
+    this->phase_patterns = phases_5pin;
+    this->phase_count = 10;
+  } else if (this->pin_count == 4 && this->half_step) {
+    this->phase_patterns = phases_4pin_half;
+    this->phase_count = 8;
+  } else if (this->pin_count == 4) {
+    this->phase_patterns = phases_4pin;
+    this->phase_count = 4;
+  } else {
+    this->phase_patterns = phases_2pin;
+    this->phase_count = 4;
+  }
+
+#if defined(ESP_PLATFORM)
+  // one register write sets and one clears every coil of a phase, as long
+  // as all the pins are in the first GPIO bank
+  int pins[5] = {motor_pin_1, motor_pin_2, motor_pin_3, motor_pin_4, motor_pin_5};
+  this->fast_gpio = true;
+  for (int i = 0; i < this->pin_count; i++) {
+    if (pins[i] < 0 || pins[i] >= 32) {
+      this->fast_gpio = false;
+    }
+  }
+  for (int phase = 0; phase < this->phase_count && this->fast_gpio; phase++) {
+    this->phase_set[phase] = 0;
+    this->phase_clear[phase] = 0;
+    for (int i = 0; i < this->pin_count; i++) {
+      if (this->phase_patterns[phase] & (1 << i))
+        this->phase_set[phase] |= 1UL << pins[i];
+      else
+        this->phase_clear[phase] |= 1UL << pins[i];
+    }
+  }
+#endif
+}
+
+/*
+ * Switches a four wire motor between full steps and half steps. Half steps
+ * double the steps per revolution; the speed in revs per minute is kept.
+ */
+void Stepper::setHalfStep(bool on)
+{
+  if (this->pin_count != 4 || on == this->half_step) {
+    return;
+  }
+  this->half_step = on;
+  if (on) {
+    this->number_of_steps *= 2;
+    this->step_number *= 2;
+    this->step_delay /= 2;
+  } else {
+    this->number_of_steps /= 2;
+    this->step_number /= 2;
+    this->step_delay *= 2;
+  }
+  initPhases();
+}
+
+#if defined(ESP_PLATFORM)
+/*
+ * Asynchronous motion. Moves are queued by target position and run one after
+ * the other from an esp_timer callback, one step per callback, so the caller
+ * returns at once and no task burns time waiting between steps. With an
+ * acceleration set, each move follows a trapezoidal speed profile: it speeds
+ * up from standstill, cruises at the setSpeed() speed and brakes to stop on
+ * its target.
+ */
+void Stepper::initAsync(void)
+{
+  this->timer = NULL;
+  portMUX_INITIALIZE(&this->lock);
+  this->acceleration = 0;
+  this->busy = false;
+  this->move_start = this->move_target = this->queued_target = 0;
+  this->move_head = this->move_count = 0;
+  this->idle_group = NULL;
+  this->idle_bits = 0;
+}
+
+/*
+ * Sets the acceleration and deceleration of asynchronous moves, in steps per
+ * second squared. 0 moves at the setSpeed() speed from the first step.
+ */
+void Stepper::setAcceleration(long stepsPerSecondPerSecond)
+{
+  this->acceleration = stepsPerSecondPerSecond;
+}
+
+/*
+ * Queues a move to an absolute position, counted in steps from home. Returns
+ * false if the move queue is full.
+ */
+bool Stepper::moveTo(long absolute)
+{
+  if (this->timer == NULL) {
+    esp_timer_create_args_t args = {};
+    args.callback = &Stepper::timerCallback;
+    args.arg = this;
+    args.name = "stepper";
+    if (esp_timer_create(&args, &this->timer) != ESP_OK) {
+      return false;
+    }
+  }
+  portENTER_CRITICAL(&this->lock);
+  if (this->move_count == STEPPER_MOVE_QUEUE) {
+    portEXIT_CRITICAL(&this->lock);
+    return false;
+  }
+  this->moves[(this->move_head + this->move_count++) % STEPPER_MOVE_QUEUE] = absolute;
+  this->queued_target = absolute;
+  bool start = !this->busy;
+  this->busy = true;
+  portEXIT_CRITICAL(&this->lock);
+  if (start) {
+    if (this->idle_group != NULL) {
+      xEventGroupClearBits(this->idle_group, this->idle_bits);
     }
+    esp_timer_start_once(this->timer, 0);
+  }
+  return true;
+}
+
+/*
+ * Drops the queued moves and heads back to position 0 once the running move
+ * is done, so a move is never cut off at speed. Use setIdleEvent() to learn
+ * when the motor is home. Returns false if the move couldn't be started.
+ */
+bool Stepper::moveHome(void)
+{
+  portENTER_CRITICAL(&this->lock);
+  this->move_count = 0;
+  this->queued_target = this->busy ? this->move_target : this->position;
+  portEXIT_CRITICAL(&this->lock);
+  return moveTo(0);
+}
+
+/*
+ * Makes the current position home. Only while idle, returns false otherwise.
+ */
+bool Stepper::setHome(void)
+{
+  portENTER_CRITICAL(&this->lock);
+  bool idle = !this->busy;
+  if (idle) {
+    this->position = 0;
+    this->move_start = this->move_target = this->queued_target = 0;
+  }
+  portEXIT_CRITICAL(&this->lock);
+  return idle;
+}
+
+/*
+ * Sets bits in an event group whenever the motor becomes idle, and clears
+ * them when a move starts, so a task can block until a move is done instead
+ * of polling isBusy().
+ */
+void Stepper::setIdleEvent(EventGroupHandle_t group, EventBits_t bits)
+{
+  this->idle_group = group;
+  this->idle_bits = bits;
+  if (group != NULL && !this->busy) {
+    xEventGroupSetBits(group, bits);
+  }
+}
+
+/*
+ * Queues a move relative to where the queued moves end. If the number is
+ * negative, the motor moves in the reverse direction. Returns false if the
+ * move queue is full.
+ */
+bool Stepper::moveAsync(long steps_to_move)
+{
+  portENTER_CRITICAL(&this->lock);
+  long target = (this->busy ? this->queued_target : this->position) + steps_to_move;
+  portEXIT_CRITICAL(&this->lock);
+  return moveTo(target);
+}
+
+/*
+ * True while a move is running or queued.
+ */
+bool Stepper::isBusy(void)
+{
+  return this->busy;
+}
+
+/*
+ * Steps from home, forward positive. Blocking step() calls are counted too.
+ */
+long Stepper::currentPosition(void)
+{
+  return this->position;
+}
+
+void Stepper::timerCallback(void *arg)
+{
+  static_cast<Stepper *>(arg)->onTimer();
+}
+
+/*
+ * Starts the next queued move that goes anywhere, with the lock held.
+ * Returns false once the queue is empty.
+ */
+bool Stepper::nextMove(void)
+{
+  while (this->move_count > 0) {
+    this->move_target = this->moves[this->move_head];
+    this->move_head = (this->move_head + 1) % STEPPER_MOVE_QUEUE;
+    this->move_count--;
+    this->move_start = this->position;
+    if (this->move_target != this->position) {
+      return true;
+    }
+  }
+  return false;
+}
+
+/*
+ * One callback per step. The callback after a move's last step picks up the
+ * next move, or goes idle.
+ */
+void Stepper::onTimer(void)
+{
+  portENTER_CRITICAL(&this->lock);
+  if (this->position == this->move_target && !nextMove()) {
+    this->busy = false;
+    portEXIT_CRITICAL(&this->lock);
+    // the esp_timer task, not an ISR, runs this
+    if (this->idle_group != NULL) {
+      xEventGroupSetBits(this->idle_group, this->idle_bits);
+    }
+    return;
+  }
+  int direction = this->move_target > this->position ? 1 : 0;
+  portEXIT_CRITICAL(&this->lock);
+
+  stepOnce(direction);
+  long done = labs(this->position - this->move_start);
+  long left = labs(this->move_target - this->position);
+  esp_timer_start_once(this->timer, profileDelay(done, left));
+}
+
+/*
+ * Delay in us until the next step: the speed reached accelerating over the
+ * steps done, or the speed to brake from over the steps left, whichever is
+ * lower, and never above the setSpeed() speed.
+ */
+uint32_t Stepper::profileDelay(long done, long left)
+{
+  if (this->acceleration <= 0) {
+    return this->step_delay;
+  }
+  long n = done < left ? done : left;
+  float speed = sqrtf(2.0f * this->acceleration * (n + 1));
+  uint32_t delay_us = (uint32_t)(1e6f / speed);
+  return delay_us < this->step_delay ? this->step_delay : delay_us;
+}
+#endif
+
+/*
+ * Moves the motor forward or backwards.
+ */
+void Stepper::stepMotor(int thisStep)
+{
+#if defined(ESP_PLATFORM)
+  if (this->fast_gpio) {
+    REG_WRITE(GPIO_OUT_W1TS_REG, this->phase_set[thisStep]);
+    REG_WRITE(GPIO_OUT_W1TC_REG, this->phase_clear[thisStep]);
+    return;
+  }
+#endif
+  int pins[5] = {motor_pin_1, motor_pin_2, motor_pin_3, motor_pin_4, motor_pin_5};
+  uint8_t pattern = this->phase_patterns[thisStep];
+  for (int i = 0; i < this->pin_count; i++) {
+    digitalWrite(pins[i], (pattern & (1 << i)) ? HIGH : LOW);
   }
 }
 
@@ -79,6 +79,16 @@
 #ifndef Stepper_h
 #define Stepper_h
 
+#if defined(ESP_PLATFORM)
+#include "esp_timer.h"
+#include "freertos/FreeRTOS.h"
+#include "freertos/event_groups.h"
+
+#define STEPPER_MOVE_QUEUE 4 // moves that can wait behind the running one
+#endif
+
+#define STEPPER_MAX_PHASES 10 // coil patterns per cycle, five phase motors
+
 // library interface description
 class Stepper {
   public:
@@ -96,10 +106,34 @@ class Stepper {
     // mover method:
     void step(int number_of_steps);
 
+    // four wire motors only:
+    void setHalfStep(bool on);
+
+#if defined(ESP_PLATFORM)
+    // asynchronous motion, stepped from an esp_timer so no task waits for it:
+    void setAcceleration(long stepsPerSecondPerSecond);
+    bool moveTo(long absolute);
+    bool moveAsync(long steps_to_move);
+    bool isBusy(void);
+    long currentPosition(void);
+    bool moveHome(void);
+    bool setHome(void);
+    void setIdleEvent(EventGroupHandle_t group, EventBits_t bits);
+#endif
+
     int version(void);
 
   private:
     void stepMotor(int this_step);
+    void stepOnce(int direction);
+    void initPhases(void);
+#if defined(ESP_PLATFORM)
+    void initAsync(void);
+    static void timerCallback(void *arg);
+    void onTimer(void);
+    bool nextMove(void);
+    uint32_t profileDelay(long done, long left);
+#endif
 
     int direction;            // Direction of rotation
     unsigned long step_delay; // delay between steps, in us, based on speed
@@ -114,7 +148,32 @@ class Stepper {
     int motor_pin_4;
     int motor_pin_5;          // Only 5 phase motor
 
+    bool half_step;                // four wire motor driven in half steps
+    const uint8_t *phase_patterns; // coil pattern per phase, bit i drives motor pin i + 1
+    int phase_count;               // phases per electrical cycle
+#if defined(ESP_PLATFORM)
+    bool fast_gpio;                // all pins below 32, see initPhases()
+    uint32_t phase_set[STEPPER_MAX_PHASES];   // GPIO_OUT_W1TS mask per phase
+    uint32_t phase_clear[STEPPER_MAX_PHASES]; // GPIO_OUT_W1TC mask per phase
+#endif
+
     unsigned long last_step_time; // timestamp in us of when the last step was taken
+    volatile long position;       // steps from home, forward positive, kept across moves
+
+#if defined(ESP_PLATFORM)
+    esp_timer_handle_t timer;     // steps the running move, created on the first one
+    portMUX_TYPE lock;            // guards the move state below against the timer
+    long acceleration;            // steps/s^2, 0 for constant speed
+    volatile bool busy;           // a move is running or queued
+    long move_start;              // position the running move started from
+    long move_target;             // position the running move ends at
+    long queued_target;           // where the motor ends up after every queued move
+    long moves[STEPPER_MOVE_QUEUE]; // targets of the queued moves
+    int move_head;                // next queued move
+    int move_count;
+    EventGroupHandle_t idle_group; // bits set while no move is running or queued
+    EventBits_t idle_bits;
+#endif
 };
 
 #endif
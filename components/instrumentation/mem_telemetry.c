@@ -0,0 +1,77 @@
+#include "mem_telemetry.h"
+#include "freertos/FreeRTOS.h"
+#include "esp_heap_caps.h"
+#include "esp_log.h"
+
+static const char *TAG = "MEM";
+
+static const char *subsystem_names[MEM_SUBSYSTEM_COUNT] = {
+    "weights", "run state", "kv cache", "tokenizer", "sampler",
+    "drafter", "sam", "neopixel", "i2s dma",
+};
+
+static mem_usage_t usage[MEM_SUBSYSTEM_COUNT];
+static portMUX_TYPE usage_lock = portMUX_INITIALIZER_UNLOCKED;
+
+void mem_telemetry_alloc(mem_subsystem_t owner, size_t bytes)
+{
+    taskENTER_CRITICAL(&usage_lock);
+    mem_usage_t *u = &usage[owner];
+    u->current += bytes;
+    u->allocs++;
+    if (u->current > u->peak)
+    {
+        u->peak = u->current;
+    }
+    taskEXIT_CRITICAL(&usage_lock);
+}
+
+void mem_telemetry_free(mem_subsystem_t owner, size_t bytes)
+{
+    taskENTER_CRITICAL(&usage_lock);
+    mem_usage_t *u = &usage[owner];
+    // an unbalanced free is a bug in the caller, clamp rather than wrap around
+    u->current = bytes > u->current ? 0 : u->current - bytes;
+    u->frees++;
+    taskEXIT_CRITICAL(&usage_lock);
+}
+
+mem_usage_t mem_telemetry_usage(mem_subsystem_t owner)
+{
+    taskENTER_CRITICAL(&usage_lock);
+    mem_usage_t u = usage[owner];
+    taskEXIT_CRITICAL(&usage_lock);
+    return u;
+}
+
+static void dump_heap(const char *name, uint32_t caps)
+{
+    size_t total = heap_caps_get_total_size(caps);
+    if (total == 0)
+    {
+        return;
+    }
+    size_t free_bytes = heap_caps_get_free_size(caps);
+    size_t largest = heap_caps_get_largest_free_block(caps);
+    // fragmentation: how much of the free memory can't be had in one allocation
+    int frag = free_bytes ? 100 - (int)(100 * largest / free_bytes) : 0;
+    ESP_LOGI(TAG, "%-9s free %7zu of %7zu, min ever %7zu, largest block %7zu, frag %3d%%",
+             name, free_bytes, total, heap_caps_get_minimum_free_size(caps), largest, frag);
+}
+
+void mem_telemetry_dump(const char *reason)
+{
+    ESP_LOGI(TAG, "memory at %s", reason);
+    for (int i = 0; i < MEM_SUBSYSTEM_COUNT; i++)
+    {
+        mem_usage_t u = mem_telemetry_usage(i);
+        if (u.allocs == 0)
+        {
+            continue;
+        }
+        ESP_LOGI(TAG, "%-9s %7zu bytes, peak %7zu, %lu allocs, %lu frees",
+                 subsystem_names[i], u.current, u.peak, (unsigned long)u.allocs, (unsigned long)u.frees);
+    }
+    dump_heap("internal", MALLOC_CAP_INTERNAL | MALLOC_CAP_8BIT);
+    dump_heap("psram", MALLOC_CAP_SPIRAM);
+}
@@ -0,0 +1,46 @@
+#ifndef MEM_TELEMETRY_H
+#define MEM_TELEMETRY_H
+
+/**
+ * Per-subsystem memory accounting. Owners report their long lived allocations
+ * here, and mem_telemetry_dump() prints them next to the heap's own view of
+ * internal DRAM and PSRAM (free, low water mark, largest block, fragmentation).
+ */
+
+#include <stddef.h>
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+typedef enum {
+    MEM_WEIGHTS,    // checkpoint weights
+    MEM_RUN_STATE,  // activations and token buffers
+    MEM_KV_CACHE,
+    MEM_TOKENIZER,  // vocab blob, sorted vocab, merge table, encode scratch
+    MEM_SAMPLER,
+    MEM_DRAFTER,
+    MEM_SAM,        // SamData while SAM is speaking
+    MEM_NEOPIXEL,   // pixel buffers
+    MEM_I2S_DMA,    // DMA buffers of the installed i2s driver
+    MEM_SUBSYSTEM_COUNT
+} mem_subsystem_t;
+
+typedef struct {
+    size_t current; // bytes held right now
+    size_t peak; // high water mark of current
+    uint32_t allocs;
+    uint32_t frees;
+} mem_usage_t;
+
+void mem_telemetry_alloc(mem_subsystem_t owner, size_t bytes);
+void mem_telemetry_free(mem_subsystem_t owner, size_t bytes);
+mem_usage_t mem_telemetry_usage(mem_subsystem_t owner);
+void mem_telemetry_dump(const char *reason);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
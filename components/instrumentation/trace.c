@@ -0,0 +1,161 @@
+#include "trace.h"
+#include <string.h>
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#include "esp_heap_caps.h"
+#include "esp_timer.h"
+#include "esp_log.h"
+
+static const char *TAG = "TRACE";
+
+typedef struct {
+    trace_event_t *events; // TRACE_RING_EVENTS, NULL while tracing is off
+    uint32_t head; // total events written, the slot is head % TRACE_RING_EVENTS
+    // task names, captured while the task is running so deleted tasks still export with a name
+    void *tasks[TRACE_MAX_TASKS];
+    char task_names[TRACE_MAX_TASKS][configMAX_TASK_NAME_LEN];
+    int n_tasks;
+    void *last_task;
+} trace_ring_t;
+
+static trace_ring_t rings[portNUM_PROCESSORS];
+
+void trace_start(void)
+{
+    // the rings live in PSRAM, they are written often but only read by trace_export
+    for (int core = 0; core < portNUM_PROCESSORS; core++)
+    {
+        if (rings[core].events == NULL)
+        {
+            rings[core].events = heap_caps_calloc(TRACE_RING_EVENTS, sizeof(trace_event_t), MALLOC_CAP_SPIRAM | MALLOC_CAP_8BIT);
+        }
+        if (rings[core].events == NULL)
+        {
+            ESP_LOGE(TAG, "no memory for the trace ring");
+            trace_stop();
+            return;
+        }
+    }
+    ESP_LOGI(TAG, "tracing %d events per core", TRACE_RING_EVENTS);
+}
+
+void trace_stop(void)
+{
+    for (int core = 0; core < portNUM_PROCESSORS; core++)
+    {
+        trace_event_t *events = rings[core].events;
+        rings[core].events = NULL;
+        heap_caps_free(events);
+    }
+    trace_clear();
+}
+
+void trace_clear(void)
+{
+    for (int core = 0; core < portNUM_PROCESSORS; core++)
+    {
+        rings[core].head = 0;
+        rings[core].n_tasks = 0;
+        rings[core].last_task = NULL;
+    }
+}
+
+int64_t trace_begin(void)
+{
+    return rings[0].events != NULL ? esp_timer_get_time() : 0;
+}
+
+static void remember_task(trace_ring_t *ring, void *task)
+{
+    // only called when the core switched tasks since its last event
+    ring->last_task = task;
+    for (int i = 0; i < ring->n_tasks; i++)
+    {
+        if (ring->tasks[i] == task)
+        {
+            return;
+        }
+    }
+    if (ring->n_tasks < TRACE_MAX_TASKS)
+    {
+        ring->tasks[ring->n_tasks] = task;
+        strncpy(ring->task_names[ring->n_tasks], pcTaskGetName(NULL), configMAX_TASK_NAME_LEN - 1);
+        ring->n_tasks++;
+    }
+}
+
+void trace_end(const char *name, int64_t start)
+{
+    if (start == 0)
+    {
+        return;
+    }
+    int64_t now = esp_timer_get_time();
+    // the ring of the core we run on; a task migrating between trace_begin and here only
+    // lands its event on the other core's timeline
+    trace_ring_t *ring = &rings[xPortGetCoreID()];
+    if (ring->events == NULL)
+    {
+        return;
+    }
+    void *task = xTaskGetCurrentTaskHandle();
+    // a task preempted by another on the same core can interleave here, so the slot is claimed
+    // atomically and everything else is per slot
+    uint32_t slot = __atomic_fetch_add(&ring->head, 1, __ATOMIC_RELAXED) % TRACE_RING_EVENTS;
+    if (task != ring->last_task || ring->n_tasks == 0)
+    {
+        remember_task(ring, task);
+    }
+    trace_event_t *event = &ring->events[slot];
+    event->name = name;
+    event->task = task;
+    event->start = start;
+    event->duration = (uint32_t)(now - start);
+}
+
+static int task_id(trace_ring_t *ring, void *task)
+{
+    for (int i = 0; i < ring->n_tasks; i++)
+    {
+        if (ring->tasks[i] == task)
+        {
+            return i;
+        }
+    }
+    return TRACE_MAX_TASKS; // seen after the table filled up
+}
+
+void trace_export(FILE *out)
+{
+    // pid is the core, tid the task on that core. call with recording paused or quiet,
+    // events written during the export may come out torn
+    fprintf(out, "{\"traceEvents\":[\n");
+    int first = 1;
+    for (int core = 0; core < portNUM_PROCESSORS; core++)
+    {
+        trace_ring_t *ring = &rings[core];
+        if (ring->events == NULL)
+        {
+            continue;
+        }
+        fprintf(out, "%s{\"ph\":\"M\",\"name\":\"process_name\",\"pid\":%d,\"args\":{\"name\":\"core %d\"}}",
+                first ? "" : ",\n", core, core);
+        first = 0;
+        for (int i = 0; i < ring->n_tasks; i++)
+        {
+            fprintf(out, ",\n{\"ph\":\"M\",\"name\":\"thread_name\",\"pid\":%d,\"tid\":%d,\"args\":{\"name\":\"%s\"}}",
+                    core, i, ring->task_names[i]);
+        }
+        uint32_t head = ring->head;
+        uint32_t count = head < TRACE_RING_EVENTS ? head : TRACE_RING_EVENTS;
+        for (uint32_t i = head - count; i != head; i++)
+        {
+            trace_event_t *event = &ring->events[i % TRACE_RING_EVENTS];
+            fprintf(out, ",\n{\"ph\":\"X\",\"name\":\"%s\",\"pid\":%d,\"tid\":%d,\"ts\":%lld,\"dur\":%lu}",
+                    event->name, core, task_id(ring, event->task), (long long)event->start,
+                    (unsigned long)event->duration);
+        }
+    }
+    fprintf(out, "\n]}\n");
+    fflush(out);
+}
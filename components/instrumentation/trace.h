@@ -0,0 +1,50 @@
+#ifndef TRACE_H
+#define TRACE_H
+
+/**
+ * Timeline tracing of the whole pipeline. Each core appends complete events
+ * (name, start, duration, task) to its own ring, so recording takes no lock;
+ * trace_export() writes the rings as Chrome trace JSON, loadable in
+ * chrome://tracing or ui.perfetto.dev. Recording is off until trace_start().
+ */
+
+#include <stdio.h>
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define TRACE_RING_EVENTS 512 // per core, the oldest events are overwritten
+#define TRACE_MAX_TASKS 16 // distinct tasks named in an export
+
+typedef struct {
+    const char *name; // must be a string literal, only the pointer is kept
+    void *task;
+    int64_t start; // esp_timer microseconds
+    uint32_t duration;
+} trace_event_t;
+
+void trace_start(void);
+void trace_stop(void);
+void trace_clear(void);
+int64_t trace_begin(void);
+void trace_end(const char *name, int64_t start);
+void trace_export(FILE *out);
+
+#ifdef __cplusplus
+}
+
+// records the enclosing scope as one event
+class TraceScope {
+public:
+    explicit TraceScope(const char *name) : name(name), start(trace_begin()) {}
+    ~TraceScope() { trace_end(name, start); }
+
+private:
+    const char *name;
+    int64_t start;
+};
+#endif
+
+#endif
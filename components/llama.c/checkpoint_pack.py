@@ -0,0 +1,87 @@
+"""
+Converts a llama2.c checkpoint .bin into the versioned, checksummed format read by
+read_checkpoint, so a truncated or corrupted file is refused at boot instead of talking
+garbage, and each group of weights can be placed in its own memory region.
+
+    python checkpoint_pack.py out/model.bin ../../data/tiny_dalek.bin
+
+Layout (little-endian), mirrored by CheckpointHeader in llm.h:
+    uint32 magic "LLM2", version
+    int32 config[7]                   as in the original header, negative vocab_size = unshared wcls
+    (uint32 offset, size, crc32)[5]   embedding, norms, attention, ffn, classifier
+    uint32 crc32                      of everything above
+    sections, each starting on a 16 byte boundary
+"""
+import struct
+import sys
+import zlib
+
+MAGIC = 0x324D4C4C
+VERSION = 1
+ALIGN = 16
+N_SECTIONS = 5
+
+
+def read_legacy(path):
+    with open(path, "rb") as f:
+        data = f.read()
+    if struct.unpack_from("<I", data, 0)[0] == MAGIC:
+        sys.exit("%s is already packed" % path)
+    config = struct.unpack_from("<7i", data, 0)
+    dim, hidden_dim, n_layers, n_heads, n_kv_heads, vocab_size, seq_len = config
+    shared = vocab_size > 0
+    vocab_size = abs(vocab_size)
+    head_size = dim // n_heads
+    kv_dim = n_kv_heads * head_size
+
+    # the same walk as memory_map_weights, in floats
+    ptr = 7 * 4
+
+    def take(n):
+        nonlocal ptr
+        chunk = data[ptr:ptr + 4 * n]
+        if len(chunk) != 4 * n:
+            sys.exit("%s is truncated" % path)
+        ptr += 4 * n
+        return chunk
+
+    embedding = take(vocab_size * dim)
+    rms_att = take(n_layers * dim)
+    attention = take(n_layers * dim * dim)
+    attention += take(n_layers * dim * kv_dim)
+    attention += take(n_layers * dim * kv_dim)
+    attention += take(n_layers * dim * dim)
+    rms_ffn = take(n_layers * dim)
+    ffn = take(n_layers * dim * hidden_dim)
+    ffn += take(n_layers * hidden_dim * dim)
+    ffn += take(n_layers * dim * hidden_dim)
+    rms_final = take(dim)
+    take(seq_len * head_size)  # what used to be freq_cis_real and freq_cis_imag
+    classifier = b"" if shared else take(vocab_size * dim)
+    return config, [embedding, rms_att + rms_ffn + rms_final, attention, ffn, classifier]
+
+
+def write_packed(path, config, sections):
+    header_size = 8 + 7 * 4 + N_SECTIONS * 12 + 4
+    table, offset = [], header_size
+    for section in sections:
+        offset += -offset % ALIGN
+        table.append((offset if section else 0, len(section), zlib.crc32(section)))
+        offset += len(section)
+    header = struct.pack("<2I7i", MAGIC, VERSION, *config)
+    for entry in table:
+        header += struct.pack("<3I", *entry)
+    header += struct.pack("<I", zlib.crc32(header))
+    out = bytearray(header)
+    for (offset, _, _), section in zip(table, sections):
+        if section:
+            out += b"\0" * (offset - len(out))
+            out += section
+    with open(path, "wb") as f:
+        f.write(out)
+
+
+if __name__ == "__main__":
+    if len(sys.argv) != 3:
+        sys.exit("usage: checkpoint_pack.py <model.bin> <packed.bin>")
+    write_packed(sys.argv[2], *read_legacy(sys.argv[1]))
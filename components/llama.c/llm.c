@@ -13,11 +13,15 @@
 #include <time.h>
 #include <math.h>
 #include <string.h>
+#include <stddef.h>
 #include <fcntl.h>
 #include "esp_log.h"
 #include "esp_system.h"
 #include "esp_dsp.h"
 #include "esp_attr.h"
+#include "esp_heap_caps.h"
+#include "esp_rom_crc.h"
+#include "trace.h"
 
 #define MAP_FAILED NULL
 #define munmap(ptr, length) custom_munmap(ptr)
@@ -40,6 +44,8 @@ typedef struct
     int end;
     int n;
     int d;
+    int batch;
+    int tiled; // w is stored in WEIGHT_TILE_ROWS row tiles
     int task_num;
 } MatMulTaskParams;
 
@@ -49,6 +55,7 @@ typedef struct
     TransformerWeights *w;
     Config *p;
     int pos;
+    int batch;
     int start;
     int loff;
     int end;
@@ -60,6 +67,16 @@ typedef struct
     int task_num;
 } ForwardTaskParams;
 
+typedef struct
+{
+    v4sf score; // vocab score of the merged token
+    int left; // index of the left token in the sequence
+    int right; // index of the right token in the sequence
+    int left_id; // token ids when the pair was queued, to detect stale candidates
+    int right_id;
+    int id; // token the pair merges into
+} MergeCandidate;
+
 EventGroupHandle_t xEventGroup;
 EventGroupHandle_t ForwardEventGroup;
 
@@ -72,17 +89,21 @@ MatMulTaskParams *matmul_params = NULL;
 
 SemaphoreHandle_t semaDataReady;
 SemaphoreHandle_t semaForwardDataReady;
+int runtime_users = 0; // transformers currently sharing the worker tasks
 
 void matmul_task(void *params);
 void forward_task(void *params);
+void build_merge_table(Tokenizer *t);
+long time_in_ms();
 
 void custom_munmap(void *ptr)
 {
-    free(ptr);
+    heap_caps_free(ptr);
 }
 
 int custom_close(int fd)
 {
+    (void)fd;
     // Since there are no actual file descriptors to close, simply return 0 (success)
     return 0;
 }
@@ -90,40 +111,96 @@ int custom_close(int fd)
 void chat(Transformer *transformer, Tokenizer *tokenizer, Sampler *sampler,
           char *cli_user_prompt, char *cli_system_prompt, int steps);
 
-void malloc_run_state(RunState *s, Config *p)
+// memory placement policy for the arenas
+#define ARENA_HOT_CAPS (MALLOC_CAP_INTERNAL | MALLOC_CAP_8BIT) // read every token
+#define ARENA_COLD_CAPS (MALLOC_CAP_SPIRAM | MALLOC_CAP_8BIT)   // large, or touched rarely
+#define ARENA_PAD(bytes) (((bytes) + ARENA_ALIGN - 1) & ~(size_t)(ARENA_ALIGN - 1))
+
+void arena_init(Arena *a, size_t size, uint32_t caps, mem_subsystem_t owner)
 {
-    // we calloc instead of malloc to keep valgrind happy
-    int kv_dim = (p->dim * p->n_kv_heads) / p->n_heads;
-    s->x = calloc(p->dim, sizeof(v4sf));
-    s->xb = calloc(p->dim, sizeof(v4sf));
-    s->xb2 = calloc(p->dim, sizeof(v4sf));
-    s->hb = calloc(p->hidden_dim, sizeof(v4sf));
-    s->hb2 = calloc(p->hidden_dim, sizeof(v4sf));
-    s->q = calloc(p->dim, sizeof(v4sf));
-    s->key_cache = calloc(p->n_layers * p->seq_len * kv_dim, sizeof(v4sf));
-    s->value_cache = calloc(p->n_layers * p->seq_len * kv_dim, sizeof(v4sf));
-    s->att = calloc(p->n_heads * p->seq_len, sizeof(v4sf));
-    s->logits = calloc(p->vocab_size, sizeof(v4sf));
-    // ensure all mallocs went fine
-    if (!s->x || !s->xb || !s->xb2 || !s->hb || !s->hb2 || !s->q || !s->key_cache || !s->value_cache || !s->att || !s->logits)
-    {
-        fprintf(stderr, "malloc failed!\n");
+    // one zeroed block from the requested memory, falling back to any 8 bit capable heap
+    a->base = heap_caps_calloc(1, size, caps);
+    if (a->base == NULL)
+    {
+        ESP_LOGW(TAG, "no room for a %zu byte arena in the preferred memory, using any", size);
+        a->base = heap_caps_calloc(1, size, MALLOC_CAP_8BIT);
+    }
+    if (a->base == NULL)
+    {
+        ESP_LOGE(TAG, "Malloc operation failed");
         exit(EXIT_FAILURE);
     }
+    a->size = size;
+    a->used = 0;
+    a->owner = owner;
+    mem_telemetry_alloc(owner, size);
+}
+
+void *arena_alloc(Arena *a, size_t bytes)
+{
+    // returns NULL when the arena is full, callers size their arenas up front with ARENA_PAD
+    size_t start = ARENA_PAD(a->used);
+    if (start + bytes > a->size)
+    {
+        return NULL;
+    }
+    a->used = start + bytes;
+    return a->base + start;
+}
+
+void arena_reset(Arena *a)
+{
+    a->used = 0;
+}
+
+void arena_free(Arena *a)
+{
+    if (a->base != NULL)
+    {
+        mem_telemetry_free(a->owner, a->size);
+    }
+    heap_caps_free(a->base);
+    a->base = NULL;
+    a->size = 0;
+    a->used = 0;
+}
+
+void malloc_run_state(RunState *s, Config *p)
+{
+    // activations hold one row per position so a whole speculative batch runs in one pass
+    int kv_dim = (p->dim * p->n_kv_heads) / p->n_heads;
+    size_t dim_bytes = LLM_MAX_BATCH * p->dim * sizeof(v4sf);
+    size_t hidden_bytes = LLM_MAX_BATCH * p->hidden_dim * sizeof(v4sf);
+    size_t att_bytes = p->n_heads * p->seq_len * sizeof(v4sf);
+    size_t logits_bytes = LLM_MAX_BATCH * p->vocab_size * sizeof(v4sf);
+    size_t prompt_bytes = (p->seq_len + 3) * sizeof(int);
+    size_t sequence_bytes = (p->seq_len + 1) * sizeof(int);
+    size_t cache_bytes = (size_t)p->n_layers * p->seq_len * kv_dim * sizeof(v4sf);
+
+    // arenas are zeroed, like the callocs they replace
+    arena_init(&s->hot, 4 * ARENA_PAD(dim_bytes) + 2 * ARENA_PAD(hidden_bytes) + ARENA_PAD(att_bytes) +
+                            ARENA_PAD(logits_bytes) + ARENA_PAD(prompt_bytes) + ARENA_PAD(sequence_bytes),
+               ARENA_HOT_CAPS, MEM_RUN_STATE);
+    arena_init(&s->cold, 2 * ARENA_PAD(cache_bytes), ARENA_COLD_CAPS, MEM_KV_CACHE);
+    s->x = arena_alloc(&s->hot, dim_bytes);
+    s->xb = arena_alloc(&s->hot, dim_bytes);
+    s->xb2 = arena_alloc(&s->hot, dim_bytes);
+    s->q = arena_alloc(&s->hot, dim_bytes);
+    s->hb = arena_alloc(&s->hot, hidden_bytes);
+    s->hb2 = arena_alloc(&s->hot, hidden_bytes);
+    s->att = arena_alloc(&s->hot, att_bytes);
+    s->logits = arena_alloc(&s->hot, logits_bytes);
+    s->prompt_tokens = arena_alloc(&s->hot, prompt_bytes);
+    s->sequence = arena_alloc(&s->hot, sequence_bytes);
+    s->key_cache = arena_alloc(&s->cold, cache_bytes);
+    s->value_cache = arena_alloc(&s->cold, cache_bytes);
+    ESP_LOGI(TAG, "RunState arenas: %zu bytes hot, %zu bytes cold", s->hot.size, s->cold.size);
 }
 
 void free_run_state(RunState *s)
 {
-    free(s->x);
-    free(s->xb);
-    free(s->xb2);
-    free(s->hb);
-    free(s->hb2);
-    free(s->q);
-    free(s->att);
-    free(s->logits);
-    free(s->key_cache);
-    free(s->value_cache);
+    arena_free(&s->hot);
+    arena_free(&s->cold);
 }
 
 void memory_map_weights(TransformerWeights *w, Config *p, v4sf *ptr, int shared_weights)
@@ -158,16 +235,160 @@ void memory_map_weights(TransformerWeights *w, Config *p, v4sf *ptr, int shared_
     w->wcls = shared_weights ? w->token_embedding_table : ptr;
 }
 
-void read_checkpoint(char *checkpoint, Config *config, TransformerWeights *weights,
-                     int *fd, v4sf **data, size_t *file_size)
+void repack_matrix(v4sf *w, int n, int d, v4sf *tmp)
+{
+    // interleave each group of WEIGHT_TILE_ROWS rows so element j of all of them is adjacent:
+    // tile[j * WEIGHT_TILE_ROWS + r] = row r, column j. leftover rows stay row-major
+    int tiles = d / WEIGHT_TILE_ROWS;
+    for (int t = 0; t < tiles; t++)
+    {
+        v4sf *tile = w + t * WEIGHT_TILE_ROWS * n;
+        memcpy(tmp, tile, WEIGHT_TILE_ROWS * n * sizeof(v4sf));
+        for (int r = 0; r < WEIGHT_TILE_ROWS; r++)
+        {
+            for (int j = 0; j < n; j++)
+            {
+                tile[j * WEIGHT_TILE_ROWS + r] = tmp[r * n + j];
+            }
+        }
+    }
+}
+
+void repack_weights(TransformerWeights *w, Config *p, int shared_weights)
+{
+    // rearrange the checkpoint's row-major matrices in place into the tiled layout matmul_rows
+    // expects. the tile is the same size as the rows it replaces so the offsets don't change
+    int kv_dim = (p->dim * p->n_kv_heads) / p->n_heads;
+    int max_n = p->dim > p->hidden_dim ? p->dim : p->hidden_dim;
+    v4sf *tmp = malloc(WEIGHT_TILE_ROWS * max_n * sizeof(v4sf));
+    if (tmp == NULL)
+    {
+        ESP_LOGE(TAG, "Malloc operation failed");
+        exit(EXIT_FAILURE);
+    }
+    for (unsigned long long l = 0; l < (unsigned long long)p->n_layers; l++)
+    {
+        repack_matrix(w->wq + l * p->dim * p->dim, p->dim, p->dim, tmp);
+        repack_matrix(w->wk + l * p->dim * kv_dim, p->dim, kv_dim, tmp);
+        repack_matrix(w->wv + l * p->dim * kv_dim, p->dim, kv_dim, tmp);
+        repack_matrix(w->wo + l * p->dim * p->dim, p->dim, p->dim, tmp);
+        repack_matrix(w->w1 + l * p->dim * p->hidden_dim, p->dim, p->hidden_dim, tmp);
+        repack_matrix(w->w2 + l * p->dim * p->hidden_dim, p->hidden_dim, p->dim, tmp);
+        repack_matrix(w->w3 + l * p->dim * p->hidden_dim, p->dim, p->hidden_dim, tmp);
+    }
+    w->tiled = 1;
+    // the embedding lookup reads whole rows, so a shared classifier has to stay row-major
+    if (!shared_weights)
+    {
+        repack_matrix(w->wcls, p->dim, p->vocab_size, tmp);
+    }
+    w->cls_tiled = !shared_weights;
+    free(tmp);
+}
+
+void map_section_weights(TransformerWeights *w, Config *p, v4sf **sections, int shared_weights)
+{
+    // same matrices as memory_map_weights, each group in its own section buffer
+    int kv_dim = (p->dim * p->n_kv_heads) / p->n_heads;
+    unsigned long long n_layers = p->n_layers;
+    w->token_embedding_table = sections[CKPT_EMBEDDING];
+    w->rms_att_weight = sections[CKPT_NORMS];
+    w->rms_ffn_weight = w->rms_att_weight + n_layers * p->dim;
+    w->rms_final_weight = w->rms_ffn_weight + n_layers * p->dim;
+    w->wq = sections[CKPT_ATTENTION];
+    w->wk = w->wq + n_layers * p->dim * p->dim;
+    w->wv = w->wk + n_layers * p->dim * kv_dim;
+    w->wo = w->wv + n_layers * p->dim * kv_dim;
+    w->w1 = sections[CKPT_FFN];
+    w->w2 = w->w1 + n_layers * p->dim * p->hidden_dim;
+    w->w3 = w->w2 + n_layers * p->hidden_dim * p->dim;
+    w->wcls = shared_weights ? w->token_embedding_table : sections[CKPT_CLASSIFIER];
+}
+
+size_t checkpoint_section_bytes(Config *p, int section, int shared_weights)
+{
+    // what the config says each section must hold
+    size_t kv_dim = (p->dim * p->n_kv_heads) / p->n_heads;
+    size_t n_layers = p->n_layers;
+    switch (section)
+    {
+    case CKPT_EMBEDDING:
+        return (size_t)p->vocab_size * p->dim * sizeof(v4sf);
+    case CKPT_NORMS:
+        return (2 * n_layers + 1) * p->dim * sizeof(v4sf);
+    case CKPT_ATTENTION:
+        return n_layers * (2 * p->dim * p->dim + 2 * p->dim * kv_dim) * sizeof(v4sf);
+    case CKPT_FFN:
+        return n_layers * 3 * p->dim * p->hidden_dim * sizeof(v4sf);
+    default:
+        return shared_weights ? 0 : (size_t)p->vocab_size * p->dim * sizeof(v4sf);
+    }
+}
+
+// the norms are read at every position of every layer and fit in internal DRAM, the
+// matrices are streamed through once per token and stay in PSRAM
+static const uint32_t section_caps[CKPT_SECTIONS] = {
+    ARENA_COLD_CAPS, ARENA_HOT_CAPS, ARENA_COLD_CAPS, ARENA_COLD_CAPS, ARENA_COLD_CAPS,
+};
+static const char *section_names[CKPT_SECTIONS] = {"embedding", "norms", "attention", "ffn", "classifier"};
+
+checkpoint_progress_cb checkpoint_progress = NULL;
+
+void set_checkpoint_progress(checkpoint_progress_cb cb)
+{
+    checkpoint_progress = cb;
+}
+
+void read_chunked(FILE *file, char *checkpoint, void *dst, size_t size, uint32_t *crc, size_t *done, size_t total)
+{
+    // fixed size blocks, so progress can be reported and the other boot tasks get a turn in between
+    uint8_t *out = dst;
+    for (size_t at = 0; at < size; at += CHECKPOINT_CHUNK)
+    {
+        size_t n = size - at < CHECKPOINT_CHUNK ? size - at : CHECKPOINT_CHUNK;
+        if (fread(out + at, 1, n, file) != n)
+        {
+            ESP_LOGE(TAG, "%s is truncated", checkpoint);
+            exit(EXIT_FAILURE);
+        }
+        if (crc != NULL)
+        {
+            *crc = esp_rom_crc32_le(*crc, out + at, n);
+        }
+        *done += n;
+        if (checkpoint_progress != NULL)
+        {
+            checkpoint_progress(checkpoint, *done, total);
+        }
+        taskYIELD();
+    }
+}
+
+void read_config(char *checkpoint, Config *config)
 {
+    // just the header, for setting up whatever depends on the model before it is loaded
     FILE *file = fopen(checkpoint, "rb");
     if (!file)
     {
         ESP_LOGE(TAG, "Couldn't open file %s", checkpoint);
         exit(EXIT_FAILURE);
     }
-    // read in the config header
+    uint32_t magic = 0;
+    fread(&magic, sizeof(magic), 1, file);
+    fseek(file, magic == CHECKPOINT_MAGIC ? offsetof(CheckpointHeader, config) : 0, SEEK_SET);
+    if (fread(config, sizeof(Config), 1, file) != 1)
+    {
+        exit(EXIT_FAILURE);
+    }
+    fclose(file);
+    config->vocab_size = abs(config->vocab_size);
+}
+
+void read_legacy_checkpoint(FILE *file, char *checkpoint, Transformer *t)
+{
+    // the original llama2.c layout: the config, then every weight in one run, nothing to verify
+    Config *config = &t->config;
+    fseek(file, 0, SEEK_SET);
     if (fread(config, sizeof(Config), 1, file) != 1)
     {
         exit(EXIT_FAILURE);
@@ -176,43 +397,134 @@ void read_checkpoint(char *checkpoint, Config *config, TransformerWeights *weigh
     int shared_weights = config->vocab_size > 0 ? 1 : 0;
     config->vocab_size = abs(config->vocab_size);
     ESP_LOGI(TAG, "Vocab size if %d", config->vocab_size);
+    ESP_LOGW(TAG, "%s has no checksums, repack it with checkpoint_pack.py", checkpoint);
     // figure out the file size
     fseek(file, 0, SEEK_END); // move file pointer to end of file
-    *file_size = ftell(file); // get the file size, in bytes
+    t->file_size = ftell(file); // get the file size, in bytes
     fseek(file, 0, SEEK_SET); // move back to beginning for reading
-    ESP_LOGI(TAG, "File size: %zu bytes", *file_size);
-    ESP_LOGI(TAG, "Free ram available: %lu", esp_get_free_heap_size());
-    *data = malloc(*file_size);
-    if (*data == NULL)
+    ESP_LOGI(TAG, "File size: %zu bytes", t->file_size);
+    // the weights are streamed through once per token, PSRAM holds them
+    t->data = heap_caps_malloc(t->file_size, ARENA_COLD_CAPS);
+    if (t->data == NULL)
     {
         ESP_LOGE(TAG, "Malloc operation failed");
         exit(EXIT_FAILURE);
     }
-    // Read the entire file into memory
-    size_t bytes_read = fread(*data, 1, *file_size, file);
-    if (bytes_read != *file_size)
+    mem_telemetry_alloc(MEM_WEIGHTS, t->file_size);
+    size_t done = 0;
+    read_chunked(file, checkpoint, t->data, t->file_size, NULL, &done, t->file_size);
+    for (int i = 0; i < CKPT_SECTIONS; i++)
     {
-        ESP_LOGE(TAG, "Failed to read file into memory");
-        ESP_LOGE(TAG, "Bytes read %zu bytes", bytes_read);
+        t->sections[i] = NULL;
+        t->section_bytes[i] = 0;
+    }
+    v4sf *weights_ptr = t->data + sizeof(Config) / sizeof(v4sf);
+    memory_map_weights(&t->weights, config, weights_ptr, shared_weights);
+    repack_weights(&t->weights, config, shared_weights);
+}
+
+void read_versioned_checkpoint(FILE *file, char *checkpoint, CheckpointHeader *header, Transformer *t)
+{
+    // every section is checked against the config and its crc, then placed where it is used best
+    if (header->version != CHECKPOINT_VERSION)
+    {
+        ESP_LOGE(TAG, "%s is version %lu, expected %d", checkpoint, (unsigned long)header->version, CHECKPOINT_VERSION);
         exit(EXIT_FAILURE);
     }
-    fclose(file);
+    if (esp_rom_crc32_le(0, (const uint8_t *)header, offsetof(CheckpointHeader, crc)) != header->crc)
+    {
+        ESP_LOGE(TAG, "%s has a corrupt header", checkpoint);
+        exit(EXIT_FAILURE);
+    }
+    Config *config = &t->config;
+    *config = header->config;
+    int shared_weights = config->vocab_size > 0 ? 1 : 0;
+    config->vocab_size = abs(config->vocab_size);
+    ESP_LOGI(TAG, "Vocab size if %d", config->vocab_size);
 
-    ESP_LOGI(TAG, "Successfully read LLM into memory");
-    ESP_LOGI(TAG, "Free ram available: %lu", esp_get_free_heap_size());
-    v4sf *weights_ptr = *data + sizeof(Config) / sizeof(v4sf);
-    memory_map_weights(weights, config, weights_ptr, shared_weights);
-    ESP_LOGI(TAG, "Successfully read checkpoint");
+    size_t total = 0;
+    for (int i = 0; i < CKPT_SECTIONS; i++)
+    {
+        size_t expected = checkpoint_section_bytes(config, i, shared_weights);
+        if (header->sections[i].size != expected)
+        {
+            ESP_LOGE(TAG, "%s section %s has %lu bytes, the config needs %zu", checkpoint, section_names[i],
+                     (unsigned long)header->sections[i].size, expected);
+            exit(EXIT_FAILURE);
+        }
+        total += expected;
+    }
+    ESP_LOGI(TAG, "Weights: %zu bytes in %d sections", total, CKPT_SECTIONS);
+
+    size_t done = 0;
+    for (int i = 0; i < CKPT_SECTIONS; i++)
+    {
+        CheckpointSection *section = &header->sections[i];
+        t->sections[i] = NULL;
+        t->section_bytes[i] = section->size;
+        if (section->size == 0)
+        {
+            continue;
+        }
+        t->sections[i] = heap_caps_malloc(section->size, section_caps[i]);
+        if (t->sections[i] == NULL && section_caps[i] != ARENA_COLD_CAPS)
+        {
+            ESP_LOGW(TAG, "No room for section %s, placing it in PSRAM", section_names[i]);
+            t->sections[i] = heap_caps_malloc(section->size, ARENA_COLD_CAPS);
+        }
+        if (t->sections[i] == NULL)
+        {
+            ESP_LOGE(TAG, "Malloc operation failed");
+            exit(EXIT_FAILURE);
+        }
+        mem_telemetry_alloc(MEM_WEIGHTS, section->size);
+        uint32_t crc = 0;
+        fseek(file, section->offset, SEEK_SET);
+        read_chunked(file, checkpoint, t->sections[i], section->size, &crc, &done, total);
+        if (crc != section->crc)
+        {
+            ESP_LOGE(TAG, "%s section %s is corrupt", checkpoint, section_names[i]);
+            exit(EXIT_FAILURE);
+        }
+    }
+    t->data = NULL;
+    t->file_size = total;
+    map_section_weights(&t->weights, config, t->sections, shared_weights);
+    repack_weights(&t->weights, config, shared_weights);
 }
 
-void build_transformer(Transformer *t, char *checkpoint_path)
+void read_checkpoint(char *checkpoint, Transformer *t)
 {
-    // read in the Config and the Weights from the checkpoint
-    read_checkpoint(checkpoint_path, &t->config, &t->weights, &t->fd, &t->data, &t->file_size);
-    // allocate the RunState buffers
-    malloc_run_state(&t->state, &t->config);
-    ESP_LOGI(TAG, "Transformer successfully built");
+    int64_t trace_start_us = trace_begin();
+    FILE *file = fopen(checkpoint, "rb");
+    if (!file)
+    {
+        ESP_LOGE(TAG, "Couldn't open file %s", checkpoint);
+        exit(EXIT_FAILURE);
+    }
+    // a versioned checkpoint starts with its magic, the original format with the config
+    CheckpointHeader header;
+    size_t got = fread(&header, 1, sizeof(header), file);
+    if (got == sizeof(header) && header.magic == CHECKPOINT_MAGIC)
+    {
+        read_versioned_checkpoint(file, checkpoint, &header, t);
+    }
+    else
+    {
+        read_legacy_checkpoint(file, checkpoint, t);
+    }
+    fclose(file);
+    trace_end("read_checkpoint", trace_start_us);
+    ESP_LOGI(TAG, "Successfully read checkpoint");
+}
 
+void acquire_runtime(void)
+{
+    // the worker tasks are shared by every transformer, the first one creates them
+    if (runtime_users++ > 0)
+    {
+        return;
+    }
     // FreeRTos Tasks
     xEventGroup = xEventGroupCreate();
     ForwardEventGroup = xEventGroupCreate();
@@ -230,19 +542,225 @@ void build_transformer(Transformer *t, char *checkpoint_path)
     ESP_LOGI(TAG, "Created FreeRTOS Tasks");
 }
 
+void release_runtime(void)
+{
+    // the last transformer to go tears the worker tasks down again
+    if (--runtime_users > 0)
+    {
+        return;
+    }
+    // both tasks sit blocked on their semaphore between forward passes, so deleting is safe
+    vTaskDelete(matmul_task_2);
+    vTaskDelete(handle_forward_task);
+    matmul_task_2 = NULL;
+    handle_forward_task = NULL;
+    vEventGroupDelete(xEventGroup);
+    vEventGroupDelete(ForwardEventGroup);
+    vSemaphoreDelete(semaDataReady);
+    vSemaphoreDelete(semaForwardDataReady);
+    free(matmul_params);
+    free(forward_params);
+    matmul_params = NULL;
+    forward_params = NULL;
+    ESP_LOGI(TAG, "Deleted FreeRTOS Tasks");
+}
+
+void build_transformer(Transformer *t, char *checkpoint_path)
+{
+    // read in the Config and the Weights from the checkpoint
+    read_checkpoint(checkpoint_path, t);
+    // allocate the RunState buffers
+    malloc_run_state(&t->state, &t->config);
+    t->owns_state = 1;
+    ESP_LOGI(TAG, "Transformer successfully built");
+
+    acquire_runtime();
+}
+
 void free_transformer(Transformer *t)
 {
     // close the memory mapping
     if (t->data != MAP_FAILED)
     {
         munmap(t->data, t->file_size);
+        mem_telemetry_free(MEM_WEIGHTS, t->file_size);
+        t->data = NULL;
+    }
+    for (int i = 0; i < CKPT_SECTIONS; i++)
+    {
+        if (t->sections[i] != NULL)
+        {
+            heap_caps_free(t->sections[i]);
+            mem_telemetry_free(MEM_WEIGHTS, t->section_bytes[i]);
+            t->sections[i] = NULL;
+        }
     }
     if (t->fd != -1)
     {
         close(t->fd);
     }
-    // free the RunState buffers
-    free_run_state(&t->state);
+    // free the RunState buffers, unless they belong to a registry
+    if (t->owns_state)
+    {
+        free_run_state(&t->state);
+    }
+    release_runtime();
+}
+
+// ----------------------------------------------------------------------------
+// Model registry: several checkpoints sharing one tokenizer, one RunState and the worker
+// tasks, switched between utterances
+
+int run_state_fits(Config *have, Config *need)
+{
+    // compare every buffer malloc_run_state sizes from the config; prompt_tokens and sequence
+    // are sized from seq_len alone
+    int have_kv_dim = (have->dim * have->n_kv_heads) / have->n_heads;
+    int need_kv_dim = (need->dim * need->n_kv_heads) / need->n_heads;
+    return need->dim <= have->dim && need->hidden_dim <= have->hidden_dim &&
+           need->n_layers * need->seq_len * need_kv_dim <= have->n_layers * have->seq_len * have_kv_dim &&
+           need->n_heads * need->seq_len <= have->n_heads * have->seq_len &&
+           need->seq_len <= have->seq_len && need->vocab_size <= have->vocab_size;
+}
+
+void registry_init(ModelRegistry *r, int max_resident)
+{
+    memset(r, 0, sizeof(ModelRegistry));
+    r->max_resident = max_resident > 0 ? max_resident : 1;
+    r->active = -1;
+}
+
+int registry_add(ModelRegistry *r, char *name, char *checkpoint_path)
+{
+    // models are only registered here, the checkpoint is read on first use
+    if (r->n_models == MAX_MODELS)
+    {
+        ESP_LOGE(TAG, "model registry full, can't add %s", name);
+        return -1;
+    }
+    ModelSlot *slot = &r->slots[r->n_models];
+    slot->name = name;
+    slot->checkpoint_path = checkpoint_path;
+    slot->loaded = 0;
+    return r->n_models++;
+}
+
+void registry_unload(ModelRegistry *r, int index)
+{
+    ModelSlot *slot = &r->slots[index];
+    free_transformer(&slot->transformer);
+    slot->loaded = 0;
+    if (r->active == index)
+    {
+        r->active = -1;
+    }
+    ESP_LOGI(TAG, "Unloaded model %s", slot->name);
+}
+
+void registry_load(ModelRegistry *r, int index)
+{
+    // hold the worker tasks across the eviction so they aren't torn down and recreated
+    acquire_runtime();
+
+    // make room by evicting the least recently used resident model
+    int resident = 0;
+    int lru = -1;
+    for (int i = 0; i < r->n_models; i++)
+    {
+        if (r->slots[i].loaded)
+        {
+            resident++;
+            if (lru == -1 || r->slots[i].last_used < r->slots[lru].last_used)
+            {
+                lru = i;
+            }
+        }
+    }
+    if (resident >= r->max_resident)
+    {
+        registry_unload(r, lru);
+    }
+
+    ModelSlot *slot = &r->slots[index];
+    Transformer *t = &slot->transformer;
+    read_checkpoint(slot->checkpoint_path, t);
+    if (r->state_config.dim != 0 && t->config.vocab_size != r->state_config.vocab_size)
+    {
+        ESP_LOGE(TAG, "model %s doesn't share the tokenizer vocab", slot->name);
+        exit(EXIT_FAILURE);
+    }
+
+    // reuse the shared RunState if it is big enough, otherwise grow it to cover both configs
+    if (r->state_config.dim == 0 || !run_state_fits(&r->state_config, &t->config))
+    {
+        Config *have = &r->state_config;
+        Config *need = &t->config;
+        if (have->dim != 0)
+        {
+            free_run_state(&r->state);
+        }
+        have->dim = need->dim > have->dim ? need->dim : have->dim;
+        have->hidden_dim = need->hidden_dim > have->hidden_dim ? need->hidden_dim : have->hidden_dim;
+        have->n_layers = need->n_layers > have->n_layers ? need->n_layers : have->n_layers;
+        have->n_heads = need->n_heads > have->n_heads ? need->n_heads : have->n_heads;
+        have->n_kv_heads = have->n_heads; // kv_dim == dim bounds every model's kv_dim
+        have->vocab_size = need->vocab_size > have->vocab_size ? need->vocab_size : have->vocab_size;
+        have->seq_len = need->seq_len > have->seq_len ? need->seq_len : have->seq_len;
+        malloc_run_state(&r->state, have);
+        ESP_LOGI(TAG, "Allocated shared RunState for dim %d, %d layers", have->dim, have->n_layers);
+    }
+    t->owns_state = 0;
+    slot->loaded = 1;
+    ESP_LOGI(TAG, "Loaded model %s", slot->name);
+}
+
+Transformer *registry_select(ModelRegistry *r, char *name)
+{
+    // switch to the named model, loading it if needed; only call between utterances
+    long start = time_in_ms();
+    int index = -1;
+    for (int i = 0; i < r->n_models; i++)
+    {
+        if (strcmp(r->slots[i].name, name) == 0)
+        {
+            index = i;
+            break;
+        }
+    }
+    if (index == -1)
+    {
+        ESP_LOGE(TAG, "unknown model %s", name);
+        return NULL;
+    }
+    ModelSlot *slot = &r->slots[index];
+    if (!slot->loaded)
+    {
+        registry_load(r, index);
+    }
+    // the shared state may have been reallocated since this model last ran
+    slot->transformer.state = r->state;
+    slot->last_used = ++r->uses;
+    if (r->active != index)
+    {
+        ESP_LOGI(TAG, "Switched to model %s in %ld ms", slot->name, time_in_ms() - start);
+        r->active = index;
+    }
+    return &slot->transformer;
+}
+
+void registry_free(ModelRegistry *r)
+{
+    for (int i = 0; i < r->n_models; i++)
+    {
+        if (r->slots[i].loaded)
+        {
+            registry_unload(r, i);
+        }
+    }
+    if (r->state_config.dim != 0)
+    {
+        free_run_state(&r->state);
+    }
 }
 
 // ----------------------------------------------------------------------------
@@ -291,27 +809,97 @@ void softmax(v4sf *x, int size)
     }
 }
 
+v4sf softmax_unnormalized(v4sf *x, int size, v4sf inv_temperature)
+{
+    // softmax of x * inv_temperature without the final normalization pass,
+    // returns the sum the probabilities would be divided by
+    v4sf max_val = x[0];
+    for (int i = 1; i < size; i++)
+    {
+        if (x[i] > max_val)
+        {
+            max_val = x[i];
+        }
+    }
+    // exp and sum, the largest value becomes exactly 1
+    v4sf sum = 0.0f;
+    for (int i = 0; i < size; i++)
+    {
+        x[i] = expf((x[i] - max_val) * inv_temperature);
+        sum += x[i];
+    }
+    return sum;
+}
+
+void matmul_rows(v4sf *xout, v4sf *x, v4sf *w, int n, int d, int start, int end, int batch, int tiled)
+{
+    // rows [start, end) of xout = w @ x for every input in the batch. start must be a multiple
+    // of WEIGHT_TILE_ROWS when w is tiled
+    int i = start;
+    if (tiled)
+    {
+        int tiled_end = (d / WEIGHT_TILE_ROWS) * WEIGHT_TILE_ROWS;
+        for (; i + WEIGHT_TILE_ROWS <= end && i < tiled_end; i += WEIGHT_TILE_ROWS)
+        {
+            // each x[j] is loaded once for WEIGHT_TILE_ROWS outputs, and the tile is read in order.
+            // plain float pointers: tiles start wherever the checkpoint put them, not on 16 bytes
+            const float *tile = &w[i * n];
+            for (int b = 0; b < batch; b++)
+            {
+                const float *xb = x + b * n;
+                float val0 = 0.0f, val1 = 0.0f, val2 = 0.0f, val3 = 0.0f;
+                for (int j = 0; j < n; j++)
+                {
+                    float xj = xb[j];
+                    const float *col = &tile[j * WEIGHT_TILE_ROWS];
+                    val0 += col[0] * xj;
+                    val1 += col[1] * xj;
+                    val2 += col[2] * xj;
+                    val3 += col[3] * xj;
+                }
+                float *out = xout + b * d + i;
+                out[0] = val0;
+                out[1] = val1;
+                out[2] = val2;
+                out[3] = val3;
+            }
+        }
+    }
+    // row-major matrices, and the rows left over after the last full tile
+    for (; i < end; i++)
+    {
+        v4sf *row = &w[i * n]; // Pointer to the start of the current row in matrix w
+        for (int b = 0; b < batch; b++)
+        {
+            v4sf val = 0.0f;
+            dsps_dotprod_f32(row, x + b * n, &val, n);
+            xout[b * d + i] = val;
+        }
+    }
+}
+
 void matmul_task(void *params)
 {
     const TickType_t xDelay = 1 / portTICK_PERIOD_MS;
     MatMulTaskParams *p = (MatMulTaskParams *)params;
     TaskHandle_t current_task = xTaskGetCurrentTaskHandle();
     char *tName = pcTaskGetName(current_task);
+    (void)tName; // only the commented-out logs use it
     // ESP_LOGI(TAG, "Created Task %s", tName);
     for (;;)
     {
         if (xSemaphoreTake(semaDataReady, portMAX_DELAY) == pdTRUE)
         {
             //   ESP_LOGI(TAG, "Started Task %s", tName);
-            for (int i = p->start; i < p->end; i++)
+            int64_t trace_start_us = trace_begin();
+            for (int i = p->start; i < p->end; i += WEIGHT_TILE_ROWS)
             {
-                v4sf val = 0.0f;
-                v4sf *row = &p->w[i * p->n]; // Pointer to the start of the current row in matrix w
-                dsps_dotprod_f32(row, p->x, &val, p->n);
-                p->xout[i] = val;
+                int end = i + WEIGHT_TILE_ROWS < p->end ? i + WEIGHT_TILE_ROWS : p->end;
+                matmul_rows(p->xout, p->x, p->w, p->n, p->d, i, end, p->batch, p->tiled);
                 // delay to avoid watchdog timer
                 vTaskDelay(xDelay);
             }
+            trace_end("matmul_task", trace_start_us);
             //    ESP_LOGI(TAG, "Completed task %s", tName);
             xSemaphoreGive(semaDataReady);
             xEventGroupSync(xEventGroup, p->task_num, ALL_SYNC_BITS, portMAX_DELAY);
@@ -319,63 +907,74 @@ void matmul_task(void *params)
     }
 }
 
+void attention_heads(ForwardTaskParams *t_params)
+{
+    // multihead attention for heads [start, end) of every position in the batch
+    for (int b = 0; b < t_params->batch; b++)
+    {
+        int pos = t_params->pos + b;
+        for (int h = t_params->start; h < t_params->end; h++)
+        {
+            // get the query vector for this head
+            v4sf *q = t_params->s->q + b * t_params->dim + h * t_params->head_size;
+            // attention scores for this head
+            v4sf *att = t_params->s->att + h * t_params->p->seq_len;
+            // iterate over all timesteps, including the current one
+            for (int t = 0; t <= pos; t++)
+            {
+                // get the key vector for this head and at this timestep
+                v4sf *k = t_params->s->key_cache + t_params->loff + t * t_params->kv_dim + (h / t_params->kv_mul) * t_params->head_size;
+                // calculate the attention score as the dot product of q and k
+                v4sf score = 0.0f;
+                for (int i = 0; i < t_params->head_size; i++)
+                {
+                    score += q[i] * k[i];
+                }
+                score /= sqrtf(t_params->head_size);
+                // save the score to the attention buffer
+                att[t] = score;
+            }
+
+            // softmax the scores to get attention weights, from 0..pos inclusively
+            softmax(att, pos + 1);
+
+            // weighted sum of the values, store back into xb
+            v4sf *xb = t_params->s->xb + b * t_params->dim + h * t_params->head_size;
+            memset(xb, 0, t_params->head_size * sizeof(v4sf));
+            for (int t = 0; t <= pos; t++)
+            {
+                // get the value vector for this head and at this timestep
+                v4sf *v = t_params->s->value_cache + t_params->loff + t * t_params->kv_dim + (h / t_params->kv_mul) * t_params->head_size;
+                // get the attention weight for this timestep
+                v4sf a = att[t];
+                // accumulate the weighted value into xb
+                for (int i = 0; i < t_params->head_size; i++)
+                {
+                    xb[i] += a * v[i];
+                }
+            }
+        }
+    }
+}
+
 void forward_task(void *params)
 {
     const TickType_t xDelay = 1 / portTICK_PERIOD_MS;
     ForwardTaskParams *t_params = (ForwardTaskParams *)params;
     TaskHandle_t current_task = xTaskGetCurrentTaskHandle();
     char *tName = pcTaskGetName(current_task);
+    (void)tName; // only the commented-out logs use it
     // ESP_LOGI(TAG, "Created Task %s", tName);
     for (;;)
     {
         if (xSemaphoreTake(semaForwardDataReady, portMAX_DELAY) == pdTRUE)
         {
             //   ESP_LOGI(TAG, "Started Task %s", tName);
-            int h;
-            // #pragma omp parallel for private(h)
-            for (h = t_params->start; h < t_params->end; h++)
-            {
-                // get the query vector for this head
-                v4sf *q = t_params->s->q + h * t_params->head_size;
-                // attention scores for this head
-                v4sf *att = t_params->s->att + h * t_params->p->seq_len;
-                // iterate over all timesteps, including the current one
-                for (int t = 0; t <= t_params->pos; t++)
-                {
-                    // get the key vector for this head and at this timestep
-                    v4sf *k = t_params->s->key_cache + t_params->loff + t * t_params->kv_dim + (h / t_params->kv_mul) * t_params->head_size;
-                    // calculate the attention score as the dot product of q and k
-                    v4sf score = 0.0f;
-                    for (int i = 0; i < t_params->head_size; i++)
-                    {
-                        score += q[i] * k[i];
-                    }
-                    score /= sqrtf(t_params->head_size);
-                    // save the score to the attention buffer
-                    att[t] = score;
-                }
-
-                // softmax the scores to get attention weights, from 0..pos inclusively
-                softmax(att, t_params->pos + 1);
-
-                // weighted sum of the values, store back into xb
-                v4sf *xb = t_params->s->xb + h * t_params->head_size;
-                memset(xb, 0, t_params->head_size * sizeof(v4sf));
-                for (int t = 0; t <= t_params->pos; t++)
-                {
-                    // get the value vector for this head and at this timestep
-                    v4sf *v = t_params->s->value_cache + t_params->loff + t * t_params->kv_dim + (h / t_params->kv_mul) * t_params->head_size;
-                    // get the attention weight for this timestep
-                    v4sf a = att[t];
-                    // accumulate the weighted value into xb
-                    for (int i = 0; i < t_params->head_size; i++)
-                    {
-                        xb[i] += a * v[i];
-                    }
-                }
-                // delay to avoid watchdog timer
-                vTaskDelay(xDelay);
-            }
+            int64_t trace_start_us = trace_begin();
+            attention_heads(t_params);
+            trace_end("forward_task", trace_start_us);
+            // delay to avoid watchdog timer
+            vTaskDelay(xDelay);
             //   ESP_LOGI(TAG, "Completed task %s", tName);
             xSemaphoreGive(semaForwardDataReady);
             xEventGroupSync(ForwardEventGroup, t_params->task_num, ALL_FORWARD_TASKS, portMAX_DELAY);
@@ -383,21 +982,19 @@ void forward_task(void *params)
     }
 }
 
-void matmul(v4sf *xout, v4sf *x, v4sf *w, int n, int d)
+void matmul(v4sf *xout, v4sf *x, v4sf *w, int n, int d, int batch, int tiled)
 {
 
     // d is the number of rows
     // n is the number of columns
-    // d X n
-    *matmul_params = (MatMulTaskParams){xout, x, w, d / 2, d, n, d, TASK_1_BIT};
+    // d X n, applied to batch input vectors x (batch, n) giving xout (batch, d)
+    // every row of w is loaded once and reused for the whole batch
+    // tiled matrices are split on a tile boundary so each core gets whole tiles
+    int64_t trace_start_us = trace_begin();
+    int half = tiled ? (d / WEIGHT_TILE_ROWS / 2) * WEIGHT_TILE_ROWS : d / 2;
+    *matmul_params = (MatMulTaskParams){xout, x, w, half, d, n, d, batch, tiled, TASK_1_BIT};
     xSemaphoreGive(semaDataReady);
-    for (int i = 0; i < d / 2; i++)
-    {
-        v4sf val = 0.0f;
-        v4sf *row = &w[i * n]; // Pointer to the start of the current row in matrix w
-        dsps_dotprod_f32(row, x, &val, n);
-        xout[i] = val;
-    }
+    matmul_rows(xout, x, w, n, d, 0, half, batch, tiled);
     if (xSemaphoreTake(semaDataReady, portMAX_DELAY) == pdTRUE)
     {
         xEventGroupSync(xEventGroup,
@@ -407,12 +1004,16 @@ void matmul(v4sf *xout, v4sf *x, v4sf *w, int n, int d)
 
         xEventGroupClearBits(xEventGroup, ALL_SYNC_BITS);
     }
+    trace_end("matmul", trace_start_us);
     //   ESP_LOGI(TAG, "Completed MatMul tasks");
 }
 
-v4sf *forward(Transformer *transformer, int token, int pos)
+v4sf *forward_batch(Transformer *transformer, int *tokens, int batch, int pos)
 {
+    // runs tokens[0..batch) at positions pos..pos+batch-1 in a single pass over the weights
+    // and returns their logits as (batch, vocab_size)
     ESP_LOGD(TAG, "ram available: %lu", esp_get_free_heap_size());
+    int64_t trace_start_us = trace_begin();
 
     // a few convenience variables
     Config *p = &transformer->config;
@@ -425,44 +1026,53 @@ v4sf *forward(Transformer *transformer, int token, int pos)
     int hidden_dim = p->hidden_dim;
     int head_size = dim / p->n_heads;
 
-    // copy the token embedding into x
-    v4sf *content_row = w->token_embedding_table + token * dim;
-    ESP_LOGD(TAG, "Content row: %f", *content_row);
-    memcpy(x, content_row, dim * sizeof(*x));
+    // copy the token embeddings into x
+    for (int b = 0; b < batch; b++)
+    {
+        v4sf *content_row = w->token_embedding_table + tokens[b] * dim;
+        ESP_LOGD(TAG, "Content row: %f", *content_row);
+        memcpy(x + b * dim, content_row, dim * sizeof(*x));
+    }
 
     // forward all the layers
-    for (unsigned long long l = 0; l < p->n_layers; l++)
+    for (unsigned long long l = 0; l < (unsigned long long)p->n_layers; l++)
     {
         ESP_LOGD(TAG, "X: %f, Weights %f", *x, *w->rms_att_weight);
         // attention rmsnorm
-        rmsnorm(s->xb, x, w->rms_att_weight + l * dim, dim);
+        for (int b = 0; b < batch; b++)
+        {
+            rmsnorm(s->xb + b * dim, x + b * dim, w->rms_att_weight + l * dim, dim);
+        }
 
-        // key and value point to the kv cache
+        // key and value point to the kv cache, the batch fills consecutive positions
         int loff = l * p->seq_len * kv_dim; // kv cache layer offset for convenience
         s->k = s->key_cache + loff + pos * kv_dim;
         s->v = s->value_cache + loff + pos * kv_dim;
 
-        // qkv matmuls for this position
-        matmul(s->q, s->xb, w->wq + l * dim * dim, dim, dim);
-        matmul(s->k, s->xb, w->wk + l * dim * kv_dim, dim, kv_dim);
-        matmul(s->v, s->xb, w->wv + l * dim * kv_dim, dim, kv_dim);
+        // qkv matmuls for these positions
+        matmul(s->q, s->xb, w->wq + l * dim * dim, dim, dim, batch, w->tiled);
+        matmul(s->k, s->xb, w->wk + l * dim * kv_dim, dim, kv_dim, batch, w->tiled);
+        matmul(s->v, s->xb, w->wv + l * dim * kv_dim, dim, kv_dim, batch, w->tiled);
 
         // RoPE relative positional encoding: complex-valued rotate q and k in each head
-        for (int i = 0; i < dim; i += 2)
-        {
-            int head_dim = i % head_size;
-            v4sf freq = 1.0f / powf(10000.0f, head_dim / (v4sf)head_size);
-            v4sf val = pos * freq;
-            v4sf fcr = cosf(val);
-            v4sf fci = sinf(val);
-            int rotn = i < kv_dim ? 2 : 1; // how many vectors? 2 = q & k, 1 = q only
-            for (int v = 0; v < rotn; v++)
+        for (int b = 0; b < batch; b++)
+        {
+            for (int i = 0; i < dim; i += 2)
             {
-                v4sf *vec = v == 0 ? s->q : s->k; // the vector to rotate (query or key)
-                v4sf v0 = vec[i];
-                v4sf v1 = vec[i + 1];
-                vec[i] = v0 * fcr - v1 * fci;
-                vec[i + 1] = v0 * fci + v1 * fcr;
+                int head_dim = i % head_size;
+                v4sf freq = 1.0f / powf(10000.0f, head_dim / (v4sf)head_size);
+                v4sf val = (pos + b) * freq;
+                v4sf fcr = cosf(val);
+                v4sf fci = sinf(val);
+                int rotn = i < kv_dim ? 2 : 1; // how many vectors? 2 = q & k, 1 = q only
+                for (int v = 0; v < rotn; v++)
+                {
+                    v4sf *vec = v == 0 ? s->q + b * dim : s->k + b * kv_dim; // the vector to rotate (query or key)
+                    v4sf v0 = vec[i];
+                    v4sf v1 = vec[i + 1];
+                    vec[i] = v0 * fcr - v1 * fci;
+                    vec[i + 1] = v0 * fci + v1 * fcr;
+                }
             }
         }
         // start task
@@ -471,6 +1081,7 @@ v4sf *forward(Transformer *transformer, int token, int pos)
             .w = w,
             .p = p,
             .pos = pos,
+            .batch = batch,
             .start = p->n_heads / 2,
             .loff = loff,
             .end = p->n_heads,
@@ -483,50 +1094,13 @@ v4sf *forward(Transformer *transformer, int token, int pos)
         };
         xSemaphoreGive(semaForwardDataReady);
 
-        // multihead attention. iterate over all heads
-        int h;
-        // #pragma omp parallel for private(h)
-        for (h = 0; h < (p->n_heads / 2); h++)
-        {
-            // get the query vector for this head
-            v4sf *q = s->q + h * head_size;
-            // attention scores for this head
-            v4sf *att = s->att + h * p->seq_len;
-            // iterate over all timesteps, including the current one
-            for (int t = 0; t <= pos; t++)
-            {
-                // get the key vector for this head and at this timestep
-                v4sf *k = s->key_cache + loff + t * kv_dim + (h / kv_mul) * head_size;
-                // calculate the attention score as the dot product of q and k
-                v4sf score = 0.0f;
-                for (int i = 0; i < head_size; i++)
-                {
-                    score += q[i] * k[i];
-                }
-                score /= sqrtf(head_size);
-                // save the score to the attention buffer
-                att[t] = score;
-            }
-
-            // softmax the scores to get attention weights, from 0..pos inclusively
-            softmax(att, pos + 1);
+        // multihead attention. iterate over the first half of the heads, the task does the rest
+        ForwardTaskParams local_params = *forward_params;
+        local_params.start = 0;
+        local_params.end = p->n_heads / 2;
+        local_params.task_num = FORWARD_TASK_2;
+        attention_heads(&local_params);
 
-            // weighted sum of the values, store back into xb
-            v4sf *xb = s->xb + h * head_size;
-            memset(xb, 0, head_size * sizeof(v4sf));
-            for (int t = 0; t <= pos; t++)
-            {
-                // get the value vector for this head and at this timestep
-                v4sf *v = s->value_cache + loff + t * kv_dim + (h / kv_mul) * head_size;
-                // get the attention weight for this timestep
-                v4sf a = att[t];
-                // accumulate the weighted value into xb
-                for (int i = 0; i < head_size; i++)
-                {
-                    xb[i] += a * v[i];
-                }
-            }
-        }
         if (xSemaphoreTake(semaForwardDataReady, portMAX_DELAY) == pdTRUE)
         {
 
@@ -538,24 +1112,27 @@ v4sf *forward(Transformer *transformer, int token, int pos)
             xEventGroupClearBits(ForwardEventGroup, ALL_FORWARD_TASKS);
 
             // final matmul to get the output of the attention
-            matmul(s->xb2, s->xb, w->wo + l * dim * dim, dim, dim);
+            matmul(s->xb2, s->xb, w->wo + l * dim * dim, dim, dim, batch, w->tiled);
 
             // residual connection back into x
-            for (int i = 0; i < dim; i++)
+            for (int i = 0; i < batch * dim; i++)
             {
                 x[i] += s->xb2[i];
             }
 
             // ffn rmsnorm
-            rmsnorm(s->xb, x, w->rms_ffn_weight + l * dim, dim);
+            for (int b = 0; b < batch; b++)
+            {
+                rmsnorm(s->xb + b * dim, x + b * dim, w->rms_ffn_weight + l * dim, dim);
+            }
 
             // Now for FFN in PyTorch we have: self.w2(F.silu(self.w1(x)) * self.w3(x))
             // first calculate self.w1(x) and self.w3(x)
-            matmul(s->hb, s->xb, w->w1 + l * dim * hidden_dim, dim, hidden_dim);
-            matmul(s->hb2, s->xb, w->w3 + l * dim * hidden_dim, dim, hidden_dim);
+            matmul(s->hb, s->xb, w->w1 + l * dim * hidden_dim, dim, hidden_dim, batch, w->tiled);
+            matmul(s->hb2, s->xb, w->w3 + l * dim * hidden_dim, dim, hidden_dim, batch, w->tiled);
 
             // SwiGLU non-linearity
-            for (int i = 0; i < hidden_dim; i++)
+            for (int i = 0; i < batch * hidden_dim; i++)
             {
                 v4sf val = s->hb[i];
                 // silu(x)=x*σ(x), where σ(x) is the logistic sigmoid
@@ -566,10 +1143,10 @@ v4sf *forward(Transformer *transformer, int token, int pos)
             }
 
             // final matmul to get the output of the ffn
-            matmul(s->xb, s->hb, w->w2 + l * dim * hidden_dim, hidden_dim, dim);
+            matmul(s->xb, s->hb, w->w2 + l * dim * hidden_dim, hidden_dim, dim, batch, w->tiled);
 
             // residual connection
-            for (int i = 0; i < dim; i++)
+            for (int i = 0; i < batch * dim; i++)
             {
                 x[i] += s->xb[i];
             }
@@ -577,99 +1154,206 @@ v4sf *forward(Transformer *transformer, int token, int pos)
     }
 
     // final rmsnorm
-    rmsnorm(x, x, w->rms_final_weight, dim);
+    for (int b = 0; b < batch; b++)
+    {
+        rmsnorm(x + b * dim, x + b * dim, w->rms_final_weight, dim);
+    }
 
     // classifier into logits
-    matmul(s->logits, x, w->wcls, p->dim, p->vocab_size);
+    matmul(s->logits, x, w->wcls, p->dim, p->vocab_size, batch, w->cls_tiled);
+    trace_end("forward", trace_start_us);
     return s->logits;
 }
 
-// ----------------------------------------------------------------------------
-// The Byte Pair Encoding (BPE) Tokenizer that translates strings <-> tokens
-
-int compare_tokens(const void *a, const void *b)
+v4sf *forward(Transformer *transformer, int token, int pos)
+{
+    return forward_batch(transformer, &token, 1, pos);
+}
+
+// ----------------------------------------------------------------------------
+// The Byte Pair Encoding (BPE) Tokenizer that translates strings <-> tokens
+
+int compare_tokens(const void *a, const void *b)
+{
+    return strcmp(((TokenIndex *)a)->str, ((TokenIndex *)b)->str);
+}
+
+size_t tokenizer_blob_size(uint32_t vocab_size, uint32_t pool_size)
+{
+    size_t size = sizeof(TokenizerBlobHeader);
+    size += vocab_size * (sizeof(v4sf) + sizeof(uint32_t));
+    size += (vocab_size * sizeof(int16_t) + 3) & ~3; // keep the pool 4-byte aligned
+    return size + pool_size;
+}
+
+void map_tokenizer_blob(Tokenizer *t)
+{
+    // point the tokenizer arrays into its blob
+    TokenizerBlobHeader *header = (TokenizerBlobHeader *)t->blob;
+    char *ptr = (char *)(header + 1);
+    t->vocab_scores = (v4sf *)ptr;
+    ptr += header->vocab_size * sizeof(v4sf);
+    t->vocab_offsets = (uint32_t *)ptr;
+    ptr += header->vocab_size * sizeof(uint32_t);
+    t->byte_map = (int16_t *)ptr;
+    ptr += (header->vocab_size * sizeof(int16_t) + 3) & ~3;
+    t->vocab_pool = ptr;
+    t->max_token_length = header->max_token_length;
+}
+
+void *read_file(char *path, size_t *size)
+{
+    // read a whole file with a single fread
+    FILE *file = fopen(path, "rb");
+    if (!file)
+    {
+        ESP_LOGE(TAG, "couldn't load %s", path);
+        exit(EXIT_FAILURE);
+    }
+    fseek(file, 0, SEEK_END);
+    *size = ftell(file);
+    fseek(file, 0, SEEK_SET);
+    void *data = malloc(*size);
+    if (data == NULL || fread(data, 1, *size, file) != *size)
+    {
+        ESP_LOGE(TAG, "failed read %s", path);
+        exit(EXIT_FAILURE);
+    }
+    fclose(file);
+    return data;
+}
+
+void *pack_legacy_tokenizer(char *data, size_t size, int vocab_size)
+{
+    // convert the original llama2.c layout (max_token_length, then score, len and string
+    // per token) into a blob so both formats end up in the same single allocation
+    char *end = data + size;
+    char *ptr = data + sizeof(int);
+    uint32_t pool_size = 0;
+    for (int i = 0; i < vocab_size; i++)
+    {
+        int len;
+        if (ptr + sizeof(v4sf) + sizeof(int) > end)
+        {
+            ESP_LOGE(TAG, "failed read vocab");
+            exit(EXIT_FAILURE);
+        }
+        memcpy(&len, ptr + sizeof(v4sf), sizeof(int));
+        ptr += sizeof(v4sf) + sizeof(int) + len;
+        pool_size += len + 1;
+    }
+    if (ptr > end)
+    {
+        ESP_LOGE(TAG, "failed read vocab");
+        exit(EXIT_FAILURE);
+    }
+
+    TokenizerBlobHeader *header = malloc(tokenizer_blob_size(vocab_size, pool_size));
+    if (header == NULL)
+    {
+        ESP_LOGE(TAG, "Malloc operation failed");
+        exit(EXIT_FAILURE);
+    }
+    header->magic = TOKENIZER_BLOB_MAGIC;
+    header->vocab_size = vocab_size;
+    memcpy(&header->max_token_length, data, sizeof(int));
+    header->pool_size = pool_size;
+
+    Tokenizer view = {.blob = header};
+    map_tokenizer_blob(&view);
+    ptr = data + sizeof(int);
+    uint32_t offset = 0;
+    for (int i = 0; i < vocab_size; i++)
+    {
+        int len;
+        memcpy(view.vocab_scores + i, ptr, sizeof(v4sf));
+        memcpy(&len, ptr + sizeof(v4sf), sizeof(int));
+        ptr += sizeof(v4sf) + sizeof(int);
+        view.vocab_offsets[i] = offset;
+        memcpy(view.vocab_pool + offset, ptr, len);
+        view.vocab_pool[offset + len] = '\0'; // add the string terminating token
+        ptr += len;
+        offset += len + 1;
+        // careful, some tokens designate raw bytes, and look like e.g. '<0x01>'
+        // parse this once here so decode is a table lookup
+        unsigned char byte_val;
+        view.byte_map[i] = sscanf(view.vocab_pool + view.vocab_offsets[i], "<0x%02hhX>", &byte_val) == 1 ? byte_val : -1;
+    }
+    return header;
+}
+
+size_t tokenizer_heap_bytes(Tokenizer *t)
 {
-    return strcmp(((TokenIndex *)a)->str, ((TokenIndex *)b)->str);
+    // the blob, sorted vocab and merge table, the scratch arena reports itself
+    TokenizerBlobHeader *header = (TokenizerBlobHeader *)t->blob;
+    return tokenizer_blob_size(header->vocab_size, header->pool_size) + t->vocab_size * sizeof(TokenIndex) +
+           (t->merges_mask + 1) * sizeof(MergeEntry);
 }
 
 void build_tokenizer(Tokenizer *t, char *tokenizer_path, int vocab_size)
 {
     // i should have written the vocab_size into the tokenizer file... sigh
+    // (the .blob format does, the original .bin format is still accepted)
     ESP_LOGI(TAG, "Vocab size is %d\n", vocab_size);
     t->vocab_size = vocab_size;
-    // malloc space to hold the scores and the strings
-    t->vocab = (char **)malloc(vocab_size * sizeof(char *));
-    t->vocab_scores = (v4sf *)malloc(vocab_size * sizeof(v4sf));
-    t->sorted_vocab = NULL; // initialized lazily
+    t->sorted_vocab = NULL; // built along with the merge table below
     for (int i = 0; i < 256; i++)
     {
         t->byte_pieces[i * 2] = (unsigned char)i;
         t->byte_pieces[i * 2 + 1] = '\0';
     }
     // read in the file
-    FILE *file = fopen(tokenizer_path, "rb");
-    if (!file)
-    {
-        ESP_LOGE(TAG, "couldn't load %s", tokenizer_path);
-        exit(EXIT_FAILURE);
-    }
+    size_t size;
+    char *data = read_file(tokenizer_path, &size);
     ESP_LOGI(TAG, "Opened Tokenizer File");
-    if (fread(&t->max_token_length, sizeof(int), 1, file) != 1)
-    {
-        ESP_LOGE(TAG, "failed read");
-        exit(EXIT_FAILURE);
-    }
-    int len;
-    for (int i = 0; i < vocab_size; i++)
+    TokenizerBlobHeader *header = (TokenizerBlobHeader *)data;
+    if (size >= sizeof(TokenizerBlobHeader) && header->magic == TOKENIZER_BLOB_MAGIC)
     {
-        if (fread(t->vocab_scores + i, sizeof(v4sf), 1, file) != 1)
-        {
-            ESP_LOGE(TAG, "failed read vocab scores");
-            exit(EXIT_FAILURE);
-        }
-        if (fread(&len, sizeof(int), 1, file) != 1)
+        // the file is already laid out the way we want it in memory
+        if (header->vocab_size != (uint32_t)vocab_size || size != tokenizer_blob_size(header->vocab_size, header->pool_size))
         {
-            ESP_LOGE(TAG, "failed read len");
+            ESP_LOGE(TAG, "tokenizer blob does not match the model vocab");
             exit(EXIT_FAILURE);
         }
-        t->vocab[i] = (char *)malloc(len + 1);
-        if (fread(t->vocab[i], len, 1, file) != 1)
-        {
-            ESP_LOGE(TAG, "failed read vocab");
-            exit(EXIT_FAILURE);
-        }
-        t->vocab[i][len] = '\0'; // add the string terminating token
+        t->blob = data;
     }
-    fclose(file);
+    else
+    {
+        t->blob = pack_legacy_tokenizer(data, size, vocab_size);
+        free(data);
+    }
+    map_tokenizer_blob(t);
+    build_merge_table(t);
+    // encode() works on at most the text plus a dummy prefix and BOS before merging
+    size_t max_n = ENCODE_SCRATCH_TEXT + 2;
+    arena_init(&t->scratch, 2 * ARENA_PAD(max_n * sizeof(int)) + ARENA_PAD(3 * max_n * sizeof(MergeCandidate)),
+               ARENA_COLD_CAPS, MEM_TOKENIZER);
+    mem_telemetry_alloc(MEM_TOKENIZER, tokenizer_heap_bytes(t));
     ESP_LOGI(TAG, "Tokenizer successfully built");
 }
 
 void free_tokenizer(Tokenizer *t)
 {
-    for (int i = 0; i < t->vocab_size; i++)
-    {
-        free(t->vocab[i]);
-    }
-    free(t->vocab);
-    free(t->vocab_scores);
+    mem_telemetry_free(MEM_TOKENIZER, tokenizer_heap_bytes(t));
+    free(t->blob);
     free(t->sorted_vocab);
+    free(t->merges);
+    arena_free(&t->scratch);
 }
 
 char *decode(Tokenizer *t, int prev_token, int token)
 {
-    char *piece = t->vocab[token];
+    // raw byte tokens map straight to their single-byte string
+    if (t->byte_map[token] >= 0)
+    {
+        return (char *)t->byte_pieces + t->byte_map[token] * 2;
+    }
+    char *piece = t->vocab_pool + t->vocab_offsets[token];
     // following BOS (1) token, sentencepiece decoder strips any leading whitespace (see PR #89)
     if (prev_token == 1 && piece[0] == ' ')
     {
         piece++;
     }
-    // careful, some tokens designate raw bytes, and look like e.g. '<0x01>'
-    // parse this and convert and return the actual byte
-    unsigned char byte_val;
-    if (sscanf(piece, "<0x%02hhX>", &byte_val) == 1)
-    {
-        piece = (char *)t->byte_pieces + byte_val * 2;
-    }
     return piece;
 }
 
@@ -704,6 +1388,156 @@ int str_lookup(char *str, TokenIndex *sorted_vocab, int vocab_size)
     return res != NULL ? res->id : -1;
 }
 
+static inline uint32_t merge_hash(uint32_t pair)
+{
+    // Knuth's multiplicative hash, the table size is a power of two
+    return pair * 2654435761u;
+}
+
+int merge_lookup(Tokenizer *t, int left, int right)
+{
+    // return the token that the pair (left, right) merges into, or -1 if there is none
+    uint32_t pair = ((uint32_t)left << 16) | (uint32_t)right;
+    for (uint32_t i = merge_hash(pair) & t->merges_mask;; i = (i + 1) & t->merges_mask)
+    {
+        if (t->merges[i].pair == pair)
+        {
+            return t->merges[i].id;
+        }
+        if (t->merges[i].pair == MERGE_EMPTY)
+        {
+            return -1;
+        }
+    }
+}
+
+int split_merges(Tokenizer *t, int id, int insert)
+{
+    // every way of cutting vocab[id] into two vocab strings is a pair that merges into id
+    // count them, and insert them into the table if asked to
+    char *str = t->vocab_pool + t->vocab_offsets[id];
+    int len = strlen(str);
+    char *left = malloc(len + 1);
+    int n_pairs = 0;
+    for (int k = 1; k < len; k++)
+    {
+        memcpy(left, str, k);
+        left[k] = '\0';
+        int left_id = str_lookup(left, t->sorted_vocab, t->vocab_size);
+        int right_id = str_lookup(str + k, t->sorted_vocab, t->vocab_size);
+        if (left_id == -1 || right_id == -1)
+        {
+            continue;
+        }
+        n_pairs++;
+        if (insert)
+        {
+            uint32_t pair = ((uint32_t)left_id << 16) | (uint32_t)right_id;
+            uint32_t i = merge_hash(pair) & t->merges_mask;
+            while (t->merges[i].pair != MERGE_EMPTY && t->merges[i].pair != pair)
+            {
+                i = (i + 1) & t->merges_mask;
+            }
+            if (t->merges[i].pair == MERGE_EMPTY)
+            {
+                t->merges[i].pair = pair;
+                t->merges[i].id = id;
+            }
+        }
+    }
+    free(left);
+    return n_pairs;
+}
+
+void build_merge_table(Tokenizer *t)
+{
+    // sort the vocabulary for string lookups, then precompute every pair -> merged token
+    // so that encode never has to concatenate strings or search the vocabulary
+    // pairs pack two ids into 32 bits, so the vocabulary must stay below 65536 tokens
+    t->sorted_vocab = malloc(t->vocab_size * sizeof(TokenIndex));
+    for (int i = 0; i < t->vocab_size; i++)
+    {
+        t->sorted_vocab[i].str = t->vocab_pool + t->vocab_offsets[i];
+        t->sorted_vocab[i].id = i;
+    }
+    qsort(t->sorted_vocab, t->vocab_size, sizeof(TokenIndex), compare_tokens);
+
+    int n_pairs = 0;
+    for (int i = 0; i < t->vocab_size; i++)
+    {
+        n_pairs += split_merges(t, i, 0);
+    }
+    // keep the load factor at or below one half so probes stay short
+    uint32_t capacity = 16;
+    while (capacity < 2 * (uint32_t)n_pairs)
+    {
+        capacity <<= 1;
+    }
+    t->merges_mask = capacity - 1;
+    t->merges = malloc(capacity * sizeof(MergeEntry));
+    for (uint32_t i = 0; i < capacity; i++)
+    {
+        t->merges[i].pair = MERGE_EMPTY;
+    }
+    for (int i = 0; i < t->vocab_size; i++)
+    {
+        split_merges(t, i, 1);
+    }
+    ESP_LOGI(TAG, "Merge table built, %d pairs", n_pairs);
+}
+
+static inline int merge_before(MergeCandidate *a, MergeCandidate *b)
+{
+    // higher score first, ties go to the leftmost pair
+    return a->score > b->score || (a->score == b->score && a->left < b->left);
+}
+
+void heap_push_pair(Tokenizer *t, int *tokens, MergeCandidate *heap, int *heap_len, int left, int right)
+{
+    // add the pair (tokens[left], tokens[right]) as a merge candidate if it is in the table
+    int id = merge_lookup(t, tokens[left], tokens[right]);
+    if (id == -1)
+    {
+        return;
+    }
+    MergeCandidate c = {t->vocab_scores[id], left, right, tokens[left], tokens[right], id};
+    int i = (*heap_len)++;
+    while (i > 0 && merge_before(&c, &heap[(i - 1) / 2]))
+    {
+        heap[i] = heap[(i - 1) / 2];
+        i = (i - 1) / 2;
+    }
+    heap[i] = c;
+}
+
+MergeCandidate heap_pop(MergeCandidate *heap, int *heap_len)
+{
+    // remove and return the best merge candidate
+    MergeCandidate top = heap[0];
+    MergeCandidate last = heap[--(*heap_len)];
+    int i = 0;
+    for (;;)
+    {
+        int child = 2 * i + 1;
+        if (child >= *heap_len)
+        {
+            break;
+        }
+        if (child + 1 < *heap_len && merge_before(&heap[child + 1], &heap[child]))
+        {
+            child++;
+        }
+        if (!merge_before(&heap[child], &last))
+        {
+            break;
+        }
+        heap[i] = heap[child];
+        i = child;
+    }
+    heap[i] = last;
+    return top;
+}
+
 void encode(Tokenizer *t, char *text, int8_t bos, int8_t eos, int *tokens, int *n_tokens)
 {
     // encode the string text (input) into an upper-bound preallocated tokens[] array
@@ -714,21 +1548,9 @@ void encode(Tokenizer *t, char *text, int8_t bos, int8_t eos, int *tokens, int *
         exit(EXIT_FAILURE);
     }
 
-    if (t->sorted_vocab == NULL)
-    {
-        // lazily malloc and sort the vocabulary
-        t->sorted_vocab = malloc(t->vocab_size * sizeof(TokenIndex));
-        for (int i = 0; i < t->vocab_size; i++)
-        {
-            t->sorted_vocab[i].str = t->vocab[i];
-            t->sorted_vocab[i].id = i;
-        }
-        qsort(t->sorted_vocab, t->vocab_size, sizeof(TokenIndex), compare_tokens);
-    }
-
-    // create a temporary buffer that will store merge candidates of always two consecutive tokens
-    // *2 for concat, +1 for null terminator +2 for UTF8 (in case max_token_length is 1)
-    char *str_buffer = malloc((t->max_token_length * 2 + 1 + 2) * sizeof(char));
+    // create a temporary buffer that will store the bytes of one UTF-8 codepoint
+    // up to 4 bytes for UTF8, +1 for null terminator
+    char str_buffer[4 + 1];
     size_t str_len = 0;
 
     // start at 0 tokens
@@ -796,7 +1618,7 @@ void encode(Tokenizer *t, char *text, int8_t bos, int8_t eos, int *tokens, int *
             // byte_fallback encoding: just encode each byte as a token
             // +3 is here because the first 3 vocab elements are <unk>, <s>, </s>
             // so the individual bytes only start at index 3
-            for (int i = 0; i < str_len; i++)
+            for (size_t i = 0; i < str_len; i++)
             {
                 tokens[(*n_tokens)++] = (unsigned char)str_buffer[i] + 3;
             }
@@ -805,46 +1627,80 @@ void encode(Tokenizer *t, char *text, int8_t bos, int8_t eos, int *tokens, int *
     }
 
     // merge the best consecutive pair each iteration, according the scores in vocab_scores
-    while (1)
+    // the candidate pairs live in a max-heap and the tokens in a linked list, so a merge only
+    // looks at its two new neighbours instead of rescanning the whole sequence
+    int n = *n_tokens;
+    // the bookkeeping comes from the scratch arena, only texts over ENCODE_SCRATCH_TEXT use the heap
+    arena_reset(&t->scratch);
+    int *next = arena_alloc(&t->scratch, n * sizeof(int)); // index of the following live token, -1 at the end
+    int *prev = arena_alloc(&t->scratch, n * sizeof(int)); // index of the preceding live token, -1 at the start
+    MergeCandidate *heap = arena_alloc(&t->scratch, 3 * n * sizeof(MergeCandidate)); // n-1 pairs + 2 per merge
+    int on_heap = heap == NULL;
+    if (on_heap)
     {
-        v4sf best_score = -1e10;
-        int best_id = -1;
-        int best_idx = -1;
+        next = malloc(n * sizeof(int));
+        prev = malloc(n * sizeof(int));
+        heap = malloc(3 * n * sizeof(MergeCandidate));
+    }
+    int heap_len = 0;
+    for (int i = 0; i < n; i++)
+    {
+        next[i] = i + 1 < n ? i + 1 : -1;
+        prev[i] = i - 1;
+    }
+    for (int i = 0; i + 1 < n; i++)
+    {
+        heap_push_pair(t, tokens, heap, &heap_len, i, i + 1);
+    }
+    while (heap_len > 0)
+    {
+        MergeCandidate best = heap_pop(heap, &heap_len);
+        // skip candidates made stale by an earlier merge of either of their tokens
+        if (tokens[best.left] != best.left_id || next[best.left] != best.right ||
+            tokens[best.right] != best.right_id)
+        {
+            continue;
+        }
 
-        for (int i = 0; i < (*n_tokens - 1); i++)
+        // merge the consecutive pair (left, right) into the new token, unlinking right
+        tokens[best.left] = best.id;
+        tokens[best.right] = -1;
+        next[best.left] = next[best.right];
+        if (next[best.right] != -1)
         {
-            // check if we can merge the pair (tokens[i], tokens[i+1])
-            sprintf(str_buffer, "%s%s", t->vocab[tokens[i]], t->vocab[tokens[i + 1]]);
-            int id = str_lookup(str_buffer, t->sorted_vocab, t->vocab_size);
-            if (id != -1 && t->vocab_scores[id] > best_score)
-            {
-                // this merge pair exists in vocab! record its score and position
-                best_score = t->vocab_scores[id];
-                best_id = id;
-                best_idx = i;
-            }
+            prev[next[best.right]] = best.left;
         }
 
-        if (best_idx == -1)
+        // the merged token forms new pairs with both of its neighbours
+        if (prev[best.left] != -1)
         {
-            break; // we couldn't find any more pairs to merge, so we're done
+            heap_push_pair(t, tokens, heap, &heap_len, prev[best.left], best.left);
         }
+        if (next[best.left] != -1)
+        {
+            heap_push_pair(t, tokens, heap, &heap_len, best.left, next[best.left]);
+        }
+    }
 
-        // merge the consecutive pair (best_idx, best_idx+1) into new token best_id
-        tokens[best_idx] = best_id;
-        // delete token at position best_idx+1, shift the entire sequence back 1
-        for (int i = best_idx + 1; i < (*n_tokens - 1); i++)
+    // compact the surviving tokens back to the front of the array
+    *n_tokens = 0;
+    for (int i = 0; i < n; i++)
+    {
+        if (tokens[i] != -1)
         {
-            tokens[i] = tokens[i + 1];
+            tokens[(*n_tokens)++] = tokens[i];
         }
-        (*n_tokens)--; // token length decreased
+    }
+    if (on_heap)
+    {
+        free(heap);
+        free(prev);
+        free(next);
     }
 
     // add optional EOS (=2) token, if desired
     if (eos)
         tokens[(*n_tokens)++] = 2;
-
-    free(str_buffer);
 }
 
 // ----------------------------------------------------------------------------
@@ -869,8 +1725,8 @@ int sample_argmax(v4sf *probabilities, int n)
 
 int sample_mult(v4sf *probabilities, int n, v4sf coin)
 {
-    // sample index from probabilities (they must sum to 1!)
-    // coin is a random number in [0, 1), usually from random_f32()
+    // sample index from probabilities, which need not be normalized
+    // coin is a random number in [0, total probability mass), usually random_f32() * mass
     v4sf cdf = 0.0f;
     for (int i = 0; i < n; i++)
     {
@@ -894,36 +1750,110 @@ int compare(const void *a, const void *b)
     return 0;
 }
 
-int sample_topp(v4sf *probabilities, int n, float topp, ProbIndex *probindex, v4sf coin)
+static inline int topp_bucket(v4sf prob)
+{
+    // positive floats order like their bit patterns, so the exponent and the top 4 mantissa
+    // bits give a monotonic log-scale bucket; 1.0f (the largest unnormalized prob) maps to the top
+    union
+    {
+        float f;
+        uint32_t u;
+    } bits = {.f = prob};
+    int bucket = (int)(bits.u >> 19) - (int)(0x3f800000u >> 19) + TOPP_BUCKETS - 1;
+    return bucket < 0 ? 0 : bucket;
+}
+
+int sample_topp(v4sf *probabilities, int n, float topp, v4sf mass, Sampler *sampler, v4sf coin)
 {
     // top-p sampling (or "nucleus sampling") samples from the smallest set of
     // tokens that exceed probability topp. This way we never sample tokens that
     // have very low probabilities and are less likely to go "off the rails".
-    // coin is a random number in [0, 1), usually from random_f32()
+    // probabilities are unnormalized and sum to mass, coin is a random number in [0, 1)
+    ProbIndex *probindex = sampler->probindex;
+    v4sf *bucket_mass = sampler->bucket_mass;
+    int *bucket_start = sampler->bucket_start;
+    const v4sf threshold = topp * mass;
 
-    int n0 = 0;
-    // quicksort indices in descending order of probabilities
+    // histogram the candidates by probability instead of sorting them all
     // values smaller than (1 - topp) / (n - 1) cannot be part of the result
-    // so for efficiency we crop these out as candidates before sorting
-    const v4sf cutoff = (1.0f - topp) / (n - 1);
+    // so for efficiency we crop these out as candidates first
+    const v4sf cutoff = (1.0f - topp) / (n - 1) * mass;
+    memset(bucket_mass, 0, TOPP_BUCKETS * sizeof(v4sf));
+    memset(bucket_start, 0, (TOPP_BUCKETS + 1) * sizeof(int));
     for (int i = 0; i < n; i++)
     {
         if (probabilities[i] >= cutoff)
         {
-            probindex[n0].index = i;
-            probindex[n0].prob = probabilities[i];
-            n0++;
+            int bucket = topp_bucket(probabilities[i]);
+            bucket_mass[bucket] += probabilities[i];
+            bucket_start[bucket]++;
         }
     }
-    qsort(probindex, n0, sizeof(ProbIndex), compare);
 
-    // truncate the list where cumulative probability exceeds topp
+    // walk the buckets from the most likely down until they hold more than topp,
+    // every bucket above that boundary is entirely inside the nucleus
     v4sf cumulative_prob = 0.0f;
+    int boundary = 0; // in case of rounding errors consider all candidates
+    for (int b = TOPP_BUCKETS - 1; b > 0; b--)
+    {
+        if (cumulative_prob + bucket_mass[b] > threshold)
+        {
+            boundary = b;
+            break;
+        }
+        cumulative_prob += bucket_mass[b];
+    }
+
+    // lay out the candidates in descending bucket order: counts become start offsets
+    int n0 = 0;
+    for (int b = TOPP_BUCKETS - 1; b >= boundary; b--)
+    {
+        int count = bucket_start[b];
+        bucket_start[b] = n0;
+        n0 += count;
+    }
+    int head = bucket_start[boundary]; // candidates strictly above the boundary bucket
+    for (int i = 0; i < n; i++)
+    {
+        if (probabilities[i] >= cutoff)
+        {
+            int bucket = topp_bucket(probabilities[i]);
+            if (bucket >= boundary)
+            {
+                probindex[bucket_start[bucket]].index = i;
+                probindex[bucket_start[bucket]].prob = probabilities[i];
+                bucket_start[bucket]++;
+            }
+        }
+    }
+
+    // only the boundary bucket needs ordering. it is usually narrow so insertion sort is enough,
+    // but bucket 0 collects the whole tail below the histogram's range and can hold most of the vocab
+    if (n0 - head > TOPP_INSERTION_SORT_MAX)
+    {
+        qsort(probindex + head, n0 - head, sizeof(ProbIndex), compare);
+    }
+    else
+    {
+        for (int i = head + 1; i < n0; i++)
+        {
+            ProbIndex key = probindex[i];
+            int j = i - 1;
+            while (j >= head && probindex[j].prob < key.prob)
+            {
+                probindex[j + 1] = probindex[j];
+                j--;
+            }
+            probindex[j + 1] = key;
+        }
+    }
+
+    // truncate the list where cumulative probability exceeds topp
     int last_idx = n0 - 1; // in case of rounding errors consider all elements
-    for (int i = 0; i < n0; i++)
+    for (int i = head; i < n0; i++)
     {
         cumulative_prob += probindex[i].prob;
-        if (cumulative_prob > topp)
+        if (cumulative_prob > threshold)
         {
             last_idx = i;
             break; // we've exceeded topp by including last_idx
@@ -950,14 +1880,22 @@ void build_sampler(Sampler *sampler, int vocab_size, float temperature, float to
     sampler->temperature = temperature;
     sampler->topp = topp;
     sampler->rng_state = rng_seed;
-    // buffer only used with nucleus sampling; may not need but it's ~small
-    sampler->probindex = malloc(sampler->vocab_size * sizeof(ProbIndex));
+    // buffers only used with nucleus sampling; may not need but they're ~small
+    // the top-p buffers are touched every token, keep them together in internal DRAM
+    size_t probindex_bytes = sampler->vocab_size * sizeof(ProbIndex);
+    size_t mass_bytes = TOPP_BUCKETS * sizeof(v4sf);
+    size_t start_bytes = (TOPP_BUCKETS + 1) * sizeof(int);
+    arena_init(&sampler->arena, ARENA_PAD(probindex_bytes) + ARENA_PAD(mass_bytes) + ARENA_PAD(start_bytes),
+               ARENA_HOT_CAPS, MEM_SAMPLER);
+    sampler->probindex = arena_alloc(&sampler->arena, probindex_bytes);
+    sampler->bucket_mass = arena_alloc(&sampler->arena, mass_bytes);
+    sampler->bucket_start = arena_alloc(&sampler->arena, start_bytes);
     ESP_LOGI(TAG, "Sampler Successfully built");
 }
 
 void free_sampler(Sampler *sampler)
 {
-    free(sampler->probindex);
+    arena_free(&sampler->arena);
 }
 
 unsigned int random_u32(unsigned long long *state)
@@ -977,6 +1915,7 @@ int sample(Sampler *sampler, v4sf *logits)
 {
     // sample the token given the logits and some hyperparameters
     int next;
+    int64_t trace_start_us = trace_begin();
     ESP_LOGD(TAG, "Sampler parameters: Temperature: %f, Top-p: %f", sampler->temperature, sampler->topp);
     if (sampler->temperature == 0.0f)
     {
@@ -985,30 +1924,125 @@ int sample(Sampler *sampler, v4sf *logits)
     }
     else
     {
-        // apply the temperature to the logits
-        for (int q = 0; q < sampler->vocab_size; q++)
-        {
-            logits[q] /= sampler->temperature;
-        }
-        // apply softmax to the logits to get the probabilities for next token
-        softmax(logits, sampler->vocab_size);
+        // apply the temperature and exponentiate in one pass, leaving the probabilities
+        // unnormalized; both samplers below scale by the total mass instead
+        v4sf mass = softmax_unnormalized(logits, sampler->vocab_size, 1.0f / sampler->temperature);
         // flip a (v4sf) coin (this is our source of entropy for sampling)
         v4sf coin = random_f32(&sampler->rng_state);
         // we sample from this distribution to get the next token
         if (sampler->topp <= 0 || sampler->topp >= 1)
         {
             // simply sample from the predicted probability distribution
-            next = sample_mult(logits, sampler->vocab_size, coin);
+            next = sample_mult(logits, sampler->vocab_size, coin * mass);
         }
         else
         {
             // top-p (nucleus) sampling, clamping the least likely tokens to zero
-            next = sample_topp(logits, sampler->vocab_size, sampler->topp, sampler->probindex, coin);
+            next = sample_topp(logits, sampler->vocab_size, sampler->topp, mass, sampler, coin);
         }
     }
+    trace_end("sample", trace_start_us);
     return next;
 }
 
+// ----------------------------------------------------------------------------
+// The Drafter, which proposes likely continuations for speculative decoding
+// proposals come from n-gram lookup over the sequence so far and an optional
+// static phrase table, and are verified by the model in one batched forward pass
+
+void build_drafter(Drafter *drafter, Tokenizer *tokenizer, int max_draft, int ngram, char *phrases_path)
+{
+    drafter->max_draft = max_draft > SPEC_MAX_DRAFT ? SPEC_MAX_DRAFT : max_draft;
+    drafter->ngram = ngram;
+    drafter->phrases = NULL;
+    drafter->n_phrases = 0;
+    if (phrases_path == NULL)
+    {
+        ESP_LOGI(TAG, "Drafter Successfully built");
+        return;
+    }
+    FILE *file = fopen(phrases_path, "r");
+    if (!file)
+    {
+        ESP_LOGW(TAG, "couldn't load %s, drafting from history only", phrases_path);
+        return;
+    }
+    // one phrase per line, encoded with the same tokenizer the model uses
+    char line[256];
+    int *line_tokens = malloc((sizeof(line) + 3) * sizeof(int));
+    int n_line_tokens = 0;
+    while (fgets(line, sizeof(line), file) != NULL)
+    {
+        line[strcspn(line, "\r\n")] = '\0';
+        if (line[0] == '\0')
+        {
+            continue;
+        }
+        encode(tokenizer, line, 0, 0, line_tokens, &n_line_tokens);
+        drafter->phrases = realloc(drafter->phrases, (drafter->n_phrases + n_line_tokens + 1) * sizeof(int));
+        memcpy(drafter->phrases + drafter->n_phrases, line_tokens, n_line_tokens * sizeof(int));
+        drafter->n_phrases += n_line_tokens;
+        drafter->phrases[drafter->n_phrases++] = -1;
+    }
+    free(line_tokens);
+    fclose(file);
+    mem_telemetry_alloc(MEM_DRAFTER, drafter->n_phrases * sizeof(int));
+    ESP_LOGI(TAG, "Drafter Successfully built, %d phrase tokens", drafter->n_phrases);
+}
+
+void free_drafter(Drafter *drafter)
+{
+    mem_telemetry_free(MEM_DRAFTER, drafter->n_phrases * sizeof(int));
+    free(drafter->phrases);
+}
+
+int ngram_lookup(int *corpus, int corpus_len, int last_start, int *key, int n, int *draft, int max_draft)
+{
+    // find the most recent occurrence of key[0..n) starting at or before last_start in corpus
+    // and copy what followed it into draft
+    for (int i = last_start; i >= 0; i--)
+    {
+        if (memcmp(corpus + i, key, n * sizeof(int)) != 0)
+        {
+            continue;
+        }
+        int n_draft = 0;
+        for (int j = i + n; j < corpus_len && n_draft < max_draft && corpus[j] >= 0; j++)
+        {
+            draft[n_draft++] = corpus[j];
+        }
+        if (n_draft > 0)
+        {
+            return n_draft;
+        }
+    }
+    return 0;
+}
+
+int propose_draft(Drafter *drafter, int *tokens, int n_tokens, int *draft, int max_draft)
+{
+    // propose up to max_draft tokens following tokens[0..n_tokens), longest matching suffix first
+    for (int n = drafter->ngram; n > 0; n--)
+    {
+        if (n > n_tokens)
+        {
+            continue;
+        }
+        int *key = tokens + n_tokens - n;
+        // skip the suffix itself when searching the history
+        int n_draft = ngram_lookup(tokens, n_tokens, n_tokens - n - 1, key, n, draft, max_draft);
+        if (n_draft == 0 && drafter->n_phrases > 0)
+        {
+            n_draft = ngram_lookup(drafter->phrases, drafter->n_phrases, drafter->n_phrases - n, key, n, draft, max_draft);
+        }
+        if (n_draft > 0)
+        {
+            return n_draft;
+        }
+    }
+    return 0;
+}
+
 // ----------------------------------------------------------------------------
 // utilities: time
 
@@ -1020,10 +2054,63 @@ long time_in_ms()
     return time.tv_sec * 1000 + time.tv_nsec / 1000000;
 }
 
+// ----------------------------------------------------------------------------
+// text ring the generated utterances are written into, owned here and read by reference
+
+TextRing text_ring;
+
+char *text_ring_begin(TextRing *r)
+{
+    // start a new utterance, at the front again if a full length one wouldn't fit before the end
+    if (r->next + TEXT_RING_MAX_UTTERANCE + 1 > TEXT_RING_SIZE)
+    {
+        r->next = 0;
+    }
+    r->head = r->next;
+    r->len = 0;
+    r->truncated = 0;
+    r->buf[r->head] = '\0';
+    return r->buf + r->head;
+}
+
+void text_ring_append(TextRing *r, const char *piece)
+{
+    // bounded copy, whatever doesn't fit in TEXT_RING_MAX_UTTERANCE is dropped
+    size_t n = strlen(piece);
+    if (r->len + n > TEXT_RING_MAX_UTTERANCE)
+    {
+        if (!r->truncated)
+        {
+            ESP_LOGW(TAG, "utterance longer than %d bytes, dropping the rest", TEXT_RING_MAX_UTTERANCE);
+            r->truncated = 1;
+        }
+        n = TEXT_RING_MAX_UTTERANCE - r->len;
+    }
+    memcpy(r->buf + r->head + r->len, piece, n);
+    r->len += n;
+    r->buf[r->head + r->len] = '\0';
+}
+
+char *text_ring_end(TextRing *r)
+{
+    // close the current utterance, the next one starts after its terminator
+    r->next = r->head + r->len + 1;
+    return r->buf + r->head;
+}
+
+char *text_ring_put(const char *text)
+{
+    // store a ready made utterance, e.g. one restored from flash, next to the generated ones.
+    // not while generate() is running, it writes the same ring
+    text_ring_begin(&text_ring);
+    text_ring_append(&text_ring, text);
+    return text_ring_end(&text_ring);
+}
+
 // ----------------------------------------------------------------------------
 // generation loop
 
-void generate(Transformer *transformer, Tokenizer *tokenizer, Sampler *sampler, char *prompt, int steps, generated_complete_cb cb_done)
+void generate(Transformer *transformer, Tokenizer *tokenizer, Sampler *sampler, Drafter *drafter, char *prompt, int steps, generated_complete_cb cb_done)
 {
     char *empty_prompt = "";
     if (prompt == NULL)
@@ -1031,11 +2118,26 @@ void generate(Transformer *transformer, Tokenizer *tokenizer, Sampler *sampler,
         prompt = empty_prompt;
     }
 
-    char* generated_text = (char *)malloc(1000 * sizeof(char));
+    char *generated_text = text_ring_begin(&text_ring);
+
+    // the token buffers are preallocated in the RunState for up to seq_len tokens
+    int seq_len = transformer->config.seq_len;
+    if (steps > seq_len)
+    {
+        steps = seq_len;
+    }
+    if (strlen(prompt) > (size_t)seq_len)
+    {
+        // still close the (empty) utterance, so the caller always hears back
+        ESP_LOGE(TAG, "prompt is longer than the %d token context", seq_len);
+        text_ring_end(&text_ring);
+        cb_done(generated_text, 0, 0.0f);
+        return;
+    }
 
     // encode the (string) prompt into tokens sequence
     int num_prompt_tokens = 0;
-    int *prompt_tokens = (int *)malloc((strlen(prompt) + 3) * sizeof(int)); // +3 for '\0', ?BOS, ?EOS
+    int *prompt_tokens = transformer->state.prompt_tokens; // +3 for '\0', ?BOS, ?EOS
     encode(tokenizer, prompt, 1, 0, prompt_tokens, &num_prompt_tokens);
     if (num_prompt_tokens < 1)
     {
@@ -1043,63 +2145,103 @@ void generate(Transformer *transformer, Tokenizer *tokenizer, Sampler *sampler,
         exit(EXIT_FAILURE);
     }
 
+    // the whole sequence so far, the drafter looks up its proposals in here
+    int *sequence = transformer->state.sequence;
+    sequence[0] = prompt_tokens[0];
+    int max_draft = drafter != NULL ? drafter->max_draft : 0;
+
     // start the main loop
     long start = 0;               // used to time our code, only initialized after first iteration
     int next;                     // will store the next token in the sequence
     int token = prompt_tokens[0]; // kick off with the first token in the prompt
     int pos = 0;                  // position in the sequence
-    int ix = 0;                   // token counter
+    int forwards = 0;             // number of forward passes, for the speculation report
+    int batch_tokens[LLM_MAX_BATCH];
     while (pos < steps)
     {
-        // forward the transformer to get logits for the next token
-        v4sf *logits = forward(transformer, token, pos);
-
-        // advance the state machine
+        // the batch is the current token followed by the draft: the rest of the prompt while
+        // we are still processing it, otherwise whatever the drafter proposes
+        int room = steps - pos - 1 < max_draft ? steps - pos - 1 : max_draft;
+        int n_draft = 0;
+        batch_tokens[0] = token;
         if (pos < num_prompt_tokens - 1)
         {
-            // if we are still processing the input prompt, force the next prompt token
-            next = prompt_tokens[pos + 1];
+            n_draft = num_prompt_tokens - 1 - pos < room ? num_prompt_tokens - 1 - pos : room;
+            memcpy(batch_tokens + 1, prompt_tokens + pos + 1, n_draft * sizeof(int));
         }
-        else
+        else if (room > 0)
         {
-            // otherwise sample the next token from the logits
-            next = sample(sampler, logits);
+            n_draft = propose_draft(drafter, sequence, pos + 1, batch_tokens + 1, room);
         }
-        pos++;
 
-        // data-dependent terminating condition: the BOS (=1) token delimits sequences
-        if (next == 1)
+        // forward the transformer to get logits for every token of the batch
+        v4sf *logits = forward_batch(transformer, batch_tokens, n_draft + 1, pos);
+        forwards++;
+
+        // walk the batch, a draft token is accepted only if it is exactly what we would have
+        // produced anyway, so the output is the same as decoding one token at a time
+        int done = 0;
+        for (int b = 0; b <= n_draft; b++)
         {
-            break;
-        }
+            // advance the state machine
+            if (pos < num_prompt_tokens - 1)
+            {
+                // if we are still processing the input prompt, force the next prompt token
+                next = prompt_tokens[pos + 1];
+            }
+            else
+            {
+                // otherwise sample the next token from the logits
+                next = sample(sampler, logits + b * transformer->config.vocab_size);
+            }
+            pos++;
+
+            // data-dependent terminating condition: the BOS (=1) token delimits sequences
+            if (next == 1)
+            {
+                done = 1;
+                break;
+            }
+
+            // print the token as string, decode it with the Tokenizer object
+            char *piece = decode(tokenizer, token, next);
+            safe_printf(piece); // same as printf("%s", piece), but skips "unsafe" bytes
+            text_ring_append(&text_ring, piece);
+            fflush(stdout);
+            token = next;
+            sequence[pos] = next;
 
-        // print the token as string, decode it with the Tokenizer object
-        char *piece = decode(tokenizer, token, next);
-        safe_printf(piece); // same as printf("%s", piece), but skips "unsafe" bytes
-        memcpy(generated_text + ix, piece, strlen(piece));
-        ix += strlen(piece);
-        fflush(stdout);
-        token = next;
+            // init the timer here because the first iteration can be slower
+            if (start == 0)
+            {
+                start = time_in_ms();
+            }
 
-        // init the timer here because the first iteration can be slower
-        if (start == 0)
+            // stop at the first mismatch, the logits after it were computed for the wrong token
+            if (b < n_draft && next != batch_tokens[b + 1])
+            {
+                break;
+            }
+        }
+        if (done)
         {
-            start = time_in_ms();
+            break;
         }
     }
     printf("\n");
+    text_ring_end(&text_ring);
 
     // report achieved tok/s (pos-1 because the timer starts after first iteration)
+    float tks = 0.0f;
     if (pos > 1)
     {
         long end = time_in_ms();
-        float tks = (pos - 1) / (double)(end - start) * 1000;
+        tks = (pos - 1) / (double)(end - start) * 1000;
         fprintf(stderr, "achieved tok/s: %f\n", tks);
-        cb_done(generated_text, ix, tks);
+        ESP_LOGI(TAG, "%d tokens in %d forward passes", pos, forwards);
     }
+    cb_done(generated_text, text_ring.len, tks);
 
-    free(prompt_tokens);
-    //free(generated_text);
     ESP_LOGI(TAG, "Generate complete");
 }
 
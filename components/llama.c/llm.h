@@ -10,22 +10,43 @@
 
 #include <stdio.h>
 #include <stdlib.h>
+#include <stdint.h>
 #include "freertos/FreeRTOS.h"
 #include "freertos/task.h"
 #include "freertos/semphr.h"
 #include "freertos/task.h"
 #include "freertos/event_groups.h"
+#include "mem_telemetry.h"
 
 typedef float v4sf __attribute__((aligned(16)));
 
+// bump allocator over one heap block: buffers are carved out once and released together
+typedef struct {
+    uint8_t *base;
+    size_t size;
+    size_t used;
+    mem_subsystem_t owner; // what the arena is reported as in the memory telemetry
+} Arena;
+
+#define ARENA_ALIGN 16 // every arena allocation starts on a v4sf boundary
+
+#define SPEC_MAX_DRAFT 4 // most tokens proposed by the drafter per speculative step
+#define LLM_MAX_BATCH (SPEC_MAX_DRAFT + 1) // positions run through one forward pass
+
 typedef struct {
     float prob;
     int index;
 } ProbIndex; // struct used when sorting probabilities during top-p sampling
 
+#define TOPP_BUCKETS 256 // log-scale probability histogram used to find the top-p nucleus
+#define TOPP_INSERTION_SORT_MAX 32 // larger boundary buckets are ordered with qsort
+
 typedef struct {
     int vocab_size;
     ProbIndex* probindex; // buffer used in top-p sampling
+    v4sf* bucket_mass; // probability mass per histogram bucket, used in top-p sampling
+    int* bucket_start; // candidate count, then start offset per histogram bucket
+    Arena arena; // holds the three buffers above, in internal DRAM
     float temperature;
     float topp;
     unsigned long long rng_state;
@@ -36,15 +57,47 @@ typedef struct {
     int id;
 } TokenIndex;
 
+#define MERGE_EMPTY 0xffffffffu // marks a free slot in the merge table
+
 typedef struct {
-    char** vocab;
+    uint32_t pair; // (left id << 16) | right id
+    int id; // token the pair merges into
+} MergeEntry;
+
+#define ENCODE_SCRATCH_TEXT 256 // longer texts fall back to the heap in encode()
+#define TOKENIZER_BLOB_MAGIC 0x314b4f54 // "TOK1"
+
+typedef struct {
+    uint32_t magic; // TOKENIZER_BLOB_MAGIC
+    uint32_t vocab_size;
+    uint32_t max_token_length;
+    uint32_t pool_size; // bytes of NUL-terminated piece strings
+    // followed by v4sf scores[vocab_size], uint32_t offsets[vocab_size],
+    // int16_t byte_map[vocab_size] padded to 4 bytes, and char pool[pool_size]
+} TokenizerBlobHeader;
+
+typedef struct {
+    void* blob; // the whole vocabulary in one allocation, laid out like a .blob file
+    uint32_t* vocab_offsets; // start of every piece in vocab_pool
+    char* vocab_pool; // NUL-terminated piece strings
+    int16_t* byte_map; // raw byte a piece like '<0x0A>' decodes to, -1 for ordinary pieces
     v4sf* vocab_scores;
     TokenIndex *sorted_vocab;
+    MergeEntry *merges; // open addressing hash map of every mergeable pair of tokens
+    uint32_t merges_mask; // merge table size - 1, the size is a power of two
     int vocab_size;
     unsigned int max_token_length;
     unsigned char byte_pieces[512]; // stores all single-byte strings
+    Arena scratch; // encode()'s merge bookkeeping, sized for ENCODE_SCRATCH_TEXT bytes of text
 } Tokenizer;
 
+typedef struct {
+    int max_draft; // tokens proposed per speculative step, 0 disables speculation
+    int ngram; // longest suffix of the sequence looked up in the history/phrase table
+    int *phrases; // static phrase table as token ids, each phrase terminated by -1
+    int n_phrases; // number of entries in phrases
+} Drafter;
+
 typedef struct {
     int dim; // transformer dimension
     int hidden_dim; // for ffn layers
@@ -55,6 +108,37 @@ typedef struct {
     int seq_len; // max sequence length
 } Config;
 
+#define CHECKPOINT_MAGIC 0x324d4c4c // "LLM2", the original llama2.c files have no magic
+#define CHECKPOINT_VERSION 1
+#define CHECKPOINT_CHUNK 16384 // bytes per read while streaming a checkpoint in
+
+// sections of a versioned checkpoint, each loaded into its own buffer
+enum {
+    CKPT_EMBEDDING, // token_embedding_table
+    CKPT_NORMS, // rms_att_weight, rms_ffn_weight, rms_final_weight
+    CKPT_ATTENTION, // wq, wk, wv, wo
+    CKPT_FFN, // w1, w2, w3
+    CKPT_CLASSIFIER, // wcls, empty when it is shared with the embedding table
+    CKPT_SECTIONS
+};
+
+typedef struct {
+    uint32_t offset; // from the start of the file, 16 byte aligned
+    uint32_t size; // bytes
+    uint32_t crc; // crc32 of the section's bytes
+} CheckpointSection;
+
+typedef struct {
+    uint32_t magic; // CHECKPOINT_MAGIC
+    uint32_t version; // CHECKPOINT_VERSION
+    Config config; // vocab_size is negative for unshared classifier weights, as in the old format
+    CheckpointSection sections[CKPT_SECTIONS];
+    uint32_t crc; // crc32 of everything above
+} CheckpointHeader;
+
+// called after every chunk read while a checkpoint loads
+typedef void (*checkpoint_progress_cb)(const char *checkpoint, size_t done, size_t total);
+
 typedef struct {
     // token embedding table
     v4sf* token_embedding_table;    // (vocab_size, dim)
@@ -74,23 +158,33 @@ typedef struct {
     v4sf* rms_final_weight; // (dim,)
     // (optional) classifier weights for the logits, on the last layer
     v4sf* wcls;
+    // layout of the matmul weights after loading, see repack_weights
+    int tiled; // wq..w3 are stored as WEIGHT_TILE_ROWS interleaved rows
+    int cls_tiled; // wcls too, only when it isn't shared with the embedding table
 } TransformerWeights;
 
 typedef struct {
-    // current wave of activations
-    v4sf *x; // activation at current time stamp (dim,)
-    v4sf *xb; // same, but inside a residual branch (dim,)
-    v4sf *xb2; // an additional buffer just for convenience (dim,)
-    v4sf *hb; // buffer for hidden dimension in the ffn (hidden_dim,)
-    v4sf *hb2; // buffer for hidden dimension in the ffn (hidden_dim,)
-    v4sf *q; // query (dim,)
-    v4sf *k; // key (dim,)
-    v4sf *v; // value (dim,)
+    // current wave of activations, one row per position of the batch
+    v4sf *x; // activation at current time stamp (batch, dim)
+    v4sf *xb; // same, but inside a residual branch (batch, dim)
+    v4sf *xb2; // an additional buffer just for convenience (batch, dim)
+    v4sf *hb; // buffer for hidden dimension in the ffn (batch, hidden_dim)
+    v4sf *hb2; // buffer for hidden dimension in the ffn (batch, hidden_dim)
+    v4sf *q; // query (batch, dim)
+    v4sf *k; // key (batch, kv_dim), points into the kv cache
+    v4sf *v; // value (batch, kv_dim), points into the kv cache
     v4sf *att; // buffer for scores/attention values (n_heads, seq_len)
-    v4sf *logits; // output logits
+    v4sf *logits; // output logits (batch, vocab_size)
     // kv cache
     v4sf* key_cache;   // (layer, seq_len, dim)
     v4sf* value_cache; // (layer, seq_len, dim)
+    // per utterance token buffers, so generate() doesn't touch the heap
+    int *prompt_tokens; // (seq_len + 3,) the encoded prompt
+    int *sequence; // (seq_len + 1,) every token so far, for the drafter
+    // placement: the activations above are touched every token and live in internal DRAM,
+    // the kv cache is by far the largest buffer and lives in PSRAM
+    Arena hot;
+    Arena cold;
 } RunState;
 
 
@@ -100,19 +194,67 @@ typedef struct {
     RunState state; // buffers for the "wave" of activations in the forward pass
     // some more state needed to properly clean up the memory mapping (sigh)
     int fd; // file descriptor for memory mapping
-    v4sf* data; // memory mapped data pointer
+    v4sf* data; // memory mapped data pointer, the whole file of an unversioned checkpoint
     size_t file_size; // size of the checkpoint file in bytes
+    v4sf* sections[CKPT_SECTIONS]; // the buffers of a versioned checkpoint, data is NULL then
+    size_t section_bytes[CKPT_SECTIONS];
+    int owns_state; // 0 when the RunState is borrowed from a ModelRegistry
 } Transformer;
 
+#define WEIGHT_TILE_ROWS 4 // rows interleaved per tile so one pass over x yields several outputs
+
+#define MAX_MODELS 4 // checkpoints a ModelRegistry can hold
+
+typedef struct {
+    char *name;
+    char *checkpoint_path;
+    Transformer transformer; // only valid while loaded
+    int loaded;
+    long last_used; // registry use counter at the last select, for eviction
+} ModelSlot;
+
+typedef struct {
+    ModelSlot slots[MAX_MODELS];
+    int n_models;
+    int max_resident; // models kept in memory at once, the least recently used is evicted
+    int active; // index of the selected model, -1 if none
+    long uses;
+    RunState state; // shared by all models, sized for the largest config loaded so far
+    Config state_config; // the config the shared state was allocated for
+} ModelRegistry;
+
 
 
+#define TEXT_RING_MAX_UTTERANCE 1023 // longer utterances are truncated; 128 steps make 400-600 chars
+#define TEXT_RING_SIZE (4 * (TEXT_RING_MAX_UTTERANCE + 1)) // bytes of generated text kept, across utterances
+
+// generated utterances, each stored contiguously and NUL terminated so consumers can read them
+// in place. an utterance stays valid until the ring wraps around onto it, which takes at least
+// TEXT_RING_SIZE / (TEXT_RING_MAX_UTTERANCE + 1) - 1 further utterances
+typedef struct {
+    char buf[TEXT_RING_SIZE];
+    size_t next; // where the next utterance starts
+    size_t head; // start of the current utterance
+    size_t len; // length of the current utterance
+    int truncated; // the current utterance lost text to TEXT_RING_MAX_UTTERANCE
+} TextRing;
+
 typedef void (*generated_complete_cb)(char *generated_text, int ix, float tk_s);
 
+void read_config(char *checkpoint, Config *config);
+void set_checkpoint_progress(checkpoint_progress_cb cb);
 void build_transformer(Transformer *t, char* checkpoint_path);
 void build_tokenizer(Tokenizer* t, char* tokenizer_path, int vocab_size);
 void build_sampler(Sampler* sampler, int vocab_size, float temperature, float topp, unsigned long long rng_seed);
-void generate(Transformer *transformer, Tokenizer *tokenizer, Sampler *sampler, char *prompt, int steps, generated_complete_cb cb_done);
+void build_drafter(Drafter* drafter, Tokenizer* tokenizer, int max_draft, int ngram, char* phrases_path);
+void generate(Transformer *transformer, Tokenizer *tokenizer, Sampler *sampler, Drafter *drafter, char *prompt, int steps, generated_complete_cb cb_done);
+char *text_ring_put(const char *text);
+void registry_init(ModelRegistry *r, int max_resident);
+int registry_add(ModelRegistry *r, char *name, char *checkpoint_path);
+Transformer *registry_select(ModelRegistry *r, char *name);
+void registry_free(ModelRegistry *r);
 void free_sampler(Sampler* sampler);
+void free_drafter(Drafter* drafter);
 void free_transformer(Transformer* t);
 void free_tokenizer(Tokenizer* t);
 
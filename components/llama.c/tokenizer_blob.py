@@ -0,0 +1,59 @@
+"""
+Converts a llama2.c tokenizer .bin into the single-blob format read by build_tokenizer,
+so the device loads the whole vocabulary with one read and no per-token allocations.
+
+    python tokenizer_blob.py ../../data/tok512.bin ../../data/tok512.blob
+
+Layout (little-endian), mirrored by TokenizerBlobHeader in llm.h:
+    uint32 magic "TOK1", vocab_size, max_token_length, pool_size
+    float32 scores[vocab_size]
+    uint32 offsets[vocab_size]        start of each piece in the pool
+    int16 byte_map[vocab_size]        byte a '<0xXX>' piece decodes to, -1 otherwise
+    (padding to 4 bytes)
+    char pool[pool_size]              NUL-terminated pieces
+"""
+import re
+import struct
+import sys
+
+MAGIC = 0x314B4F54
+
+
+def read_legacy(path):
+    with open(path, "rb") as f:
+        data = f.read()
+    (max_token_length,) = struct.unpack_from("<i", data, 0)
+    ptr = 4
+    scores, pieces = [], []
+    while ptr < len(data):
+        score, length = struct.unpack_from("<fi", data, ptr)
+        ptr += 8
+        scores.append(score)
+        pieces.append(data[ptr:ptr + length])
+        ptr += length
+    return max_token_length, scores, pieces
+
+
+def write_blob(path, max_token_length, scores, pieces):
+    offsets, byte_map, pool = [], [], bytearray()
+    for piece in pieces:
+        offsets.append(len(pool))
+        pool += piece + b"\0"
+        # same rule as sscanf(piece, "<0x%02hhX>") in the C decoder
+        m = re.match(rb"<0x([0-9A-Fa-f]{1,2})", piece)
+        byte_map.append(int(m.group(1), 16) if m else -1)
+    n = len(pieces)
+    out = bytearray(struct.pack("<4I", MAGIC, n, max_token_length, len(pool)))
+    out += struct.pack("<%df" % n, *scores)
+    out += struct.pack("<%dI" % n, *offsets)
+    out += struct.pack("<%dh" % n, *byte_map)
+    out += b"\0" * (-len(out) % 4)
+    out += pool
+    with open(path, "wb") as f:
+        f.write(out)
+
+
+if __name__ == "__main__":
+    if len(sys.argv) != 3:
+        sys.exit("usage: tokenizer_blob.py <tokenizer.bin> <tokenizer.blob>")
+    write_blob(sys.argv[2], *read_legacy(sys.argv[1]))
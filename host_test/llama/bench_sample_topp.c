@@ -0,0 +1,64 @@
+// Time per call of the histogram top-p sampler against the qsort version it replaced, each
+// including its softmax, on a vocabulary the size of the production tokenizer's.
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include "topp_reference.h"
+
+#define VOCAB 512
+#define CALLS 100000
+
+static double now(void)
+{
+    struct timespec t;
+    clock_gettime(CLOCK_MONOTONIC, &t);
+    return t.tv_sec + t.tv_nsec * 1e-9;
+}
+
+static Sampler sampler;
+static ProbIndex reference_index[VOCAB];
+
+static void bench(const char *name, const float *logits, float temperature, float topp)
+{
+    float probs[VOCAB];
+    unsigned long long seed = 7;
+    volatile int sink = 0;
+    double start = now();
+    for (int k = 0; k < CALLS; k++)
+    {
+        for (int i = 0; i < VOCAB; i++)
+            probs[i] = logits[i] / temperature;
+        softmax(probs, VOCAB);
+        sink += reference_sample_topp(probs, VOCAB, topp, reference_index, random_f32(&seed));
+    }
+    double reference_s = now() - start;
+    start = now();
+    for (int k = 0; k < CALLS; k++)
+    {
+        memcpy(probs, logits, sizeof(probs));
+        v4sf mass = softmax_unnormalized(probs, VOCAB, 1.0f / temperature);
+        sink += sample_topp(probs, VOCAB, topp, mass, &sampler, random_f32(&seed));
+    }
+    double histogram_s = now() - start;
+    printf("%-12s T=%.2f topp=%.4g: qsort %.2f us, histogram %.2f us per call\n", name, temperature, topp,
+           reference_s / CALLS * 1e6, histogram_s / CALLS * 1e6);
+}
+
+int main(void)
+{
+    float logits[VOCAB];
+    build_sampler(&sampler, VOCAB, 1.0f, 0.9f, 42);
+    unsigned long long seed = 7;
+    for (int i = 0; i < VOCAB; i++)
+        logits[i] = (random_f32(&seed) - 0.5f) * 6.0f;
+    bench("random", logits, 0.25f, 0.9f);
+    bench("random", logits, 1.0f, 0.9f);
+
+    // worst case: the nucleus ends in a tail that all falls in histogram bucket 0
+    for (int i = 0; i < VOCAB; i++)
+        logits[i] = i == 0 ? 0.0f : -11.5f - 0.002f * (i * 97 % VOCAB);
+    bench("long tail", logits, 1.0f, 0.999f);
+
+    free_sampler(&sampler);
+    return 0;
+}
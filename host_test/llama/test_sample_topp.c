@@ -0,0 +1,132 @@
+// Checks that the histogram top-p sampler picks from the same nucleus, with the same
+// probabilities, as the qsort version it replaced. Both are driven with the same grid of
+// coins; tokens with equal logits are compared as one group, because the two sorts may
+// order ties differently.
+#include <math.h>
+#include <stdio.h>
+#include <string.h>
+#include "topp_reference.h"
+
+#define VOCAB 512
+#define COINS 8192
+#define MAX_COIN_DIFF 2 // coins landing differently, from float rounding near a cdf step
+
+static Sampler sampler;
+static ProbIndex reference_index[VOCAB];
+static int failures;
+
+// coins spread over [coin_from, 1), to look closely at the unlikely end of the nucleus
+static void check_coins(const char *name, const float *logits, float temperature, float topp, float coin_from)
+{
+    static int reference_hits[VOCAB], hits[VOCAB];
+    float probs[VOCAB];
+    memset(reference_hits, 0, sizeof(reference_hits));
+    memset(hits, 0, sizeof(hits));
+    for (int k = 0; k < COINS; k++)
+    {
+        v4sf coin = coin_from + (1.0f - coin_from) * (k + 0.5f) / COINS;
+        // the old path: scale, normalize, sort
+        for (int i = 0; i < VOCAB; i++)
+            probs[i] = logits[i] / temperature;
+        softmax(probs, VOCAB);
+        reference_hits[reference_sample_topp(probs, VOCAB, topp, reference_index, coin)]++;
+        // the new path: one unnormalized exp pass, histogram
+        memcpy(probs, logits, sizeof(probs));
+        v4sf mass = softmax_unnormalized(probs, VOCAB, 1.0f / temperature);
+        hits[sample_topp(probs, VOCAB, topp, mass, &sampler, coin)]++;
+    }
+
+    int worst = 0, worst_token = 0;
+    for (int i = 0; i < VOCAB; i++)
+    {
+        int reference_group = 0, group = 0;
+        for (int j = 0; j < VOCAB; j++)
+        {
+            if (logits[j] == logits[i])
+            {
+                reference_group += reference_hits[j];
+                group += hits[j];
+            }
+        }
+        int diff = abs(reference_group - group);
+        if (diff > worst)
+        {
+            worst = diff;
+            worst_token = i;
+        }
+    }
+    printf("%-28s T=%.2f topp=%.4g: %d coins differ at most (token %d)\n", name, temperature, topp, worst,
+           worst_token);
+    if (worst > MAX_COIN_DIFF)
+    {
+        printf("  FAIL: more than %d coins differ\n", MAX_COIN_DIFF);
+        failures++;
+    }
+}
+
+static void check(const char *name, const float *logits, float temperature, float topp)
+{
+    check_coins(name, logits, temperature, topp, 0.0f);
+}
+
+static void random_logits(float *logits, unsigned long long seed, float spread)
+{
+    for (int i = 0; i < VOCAB; i++)
+    {
+        logits[i] = (random_f32(&seed) - 0.5f) * spread;
+        if (i % 37 == 0)
+            logits[i] += 5.0f; // a few likely tokens, as in a real distribution
+    }
+}
+
+int main(void)
+{
+    static const float temperatures[] = {0.25f, 0.7f, 1.0f};
+    static const float topps[] = {0.5f, 0.9f, 0.95f};
+    float logits[VOCAB];
+    build_sampler(&sampler, VOCAB, 1.0f, 0.9f, 42);
+
+    for (unsigned long long seed = 1; seed <= 4; seed++)
+    {
+        random_logits(logits, seed, 4.0f * seed);
+        for (int t = 0; t < 3; t++)
+            for (int p = 0; p < 3; p++)
+                check("random logits", logits, temperatures[t], topps[p]);
+    }
+
+    // few distinct values, so the nucleus boundary falls inside a run of ties
+    random_logits(logits, 7, 8.0f);
+    for (int i = 0; i < VOCAB; i++)
+        logits[i] = floorf(logits[i]);
+    for (int p = 0; p < 3; p++)
+        check("tied logits", logits, 1.0f, topps[p]);
+
+    // no truncation: sample() doesn't call sample_topp for topp >= 1, but it must still work
+    random_logits(logits, 11, 6.0f);
+    check("topp 1.0", logits, 1.0f, 1.0f);
+    check("topp 1.0", logits, 0.7f, 1.0f);
+
+    // every candidate in one histogram bucket
+    for (int i = 0; i < VOCAB; i++)
+        logits[i] = 0.0f;
+    check("uniform", logits, 1.0f, 0.9f);
+    for (int i = 0; i < VOCAB; i++)
+        logits[i] = 0.01f * (i % 5);
+    check("within one bucket", logits, 1.0f, 0.9f);
+
+    // a long tail below the histogram's range, all in bucket 0 and all distinct, with the
+    // nucleus boundary inside it
+    for (int i = 0; i < VOCAB; i++)
+        logits[i] = i == 0 ? 0.0f : -11.5f - 0.002f * (i * 97 % VOCAB);
+    check_coins("long tail in bucket 0", logits, 1.0f, 0.999f, 0.99f);
+    check_coins("long tail in bucket 0", logits, 1.0f, 0.9999f, 0.99f);
+
+    // all the mass on one token
+    for (int i = 0; i < VOCAB; i++)
+        logits[i] = i == 123 ? 40.0f : 0.0f;
+    check("one token", logits, 1.0f, 0.9f);
+
+    free_sampler(&sampler);
+    printf(failures ? "%d checks FAILED\n" : "all checks passed\n", failures);
+    return failures != 0;
+}
@@ -0,0 +1,93 @@
+// Runs generate() on the small checkpoint in data/ with speculative decoding off and with the
+// longest drafts, on the worker tasks the firmware uses, and checks that both write the same
+// text: a draft token is only kept when it is what plain decoding would have produced. Greedy
+// and sampled decoding are both covered, the sampler reseeded the same way for each run.
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include "llm.h"
+
+#define STEPS 128
+
+static const char *prompts[] = {"EXT", "A", "D", "M", "Q", "Z", "EXTERMINATE! EXTERMINATE!", "The Daleks will"};
+#define N_PROMPTS (int)(sizeof(prompts) / sizeof(prompts[0]))
+
+static Transformer transformer;
+static Tokenizer tokenizer;
+static char texts[N_PROMPTS][TEXT_RING_MAX_UTTERANCE + 1];
+static int completed;
+static int failures;
+
+static void generate_complete_cb(char *generated_text, int ix, float tk_s)
+{
+    (void)tk_s;
+    snprintf(texts[completed++], sizeof(texts[0]), "%.*s", ix, generated_text);
+}
+
+static double now(void)
+{
+    struct timespec t;
+    clock_gettime(CLOCK_MONOTONIC, &t);
+    return t.tv_sec + t.tv_nsec * 1e-9;
+}
+
+// every prompt once, returns the seconds taken
+static double run(float temperature, int max_draft)
+{
+    Sampler sampler;
+    Drafter drafter;
+    build_sampler(&sampler, transformer.config.vocab_size, temperature, 0.9f, 1234);
+    build_drafter(&drafter, &tokenizer, max_draft, 3, NULL);
+    completed = 0;
+    double start = now();
+    for (int i = 0; i < N_PROMPTS; i++)
+        generate(&transformer, &tokenizer, &sampler, &drafter, (char *)prompts[i], STEPS, generate_complete_cb);
+    double seconds = now() - start;
+    free_drafter(&drafter);
+    free_sampler(&sampler);
+    return seconds;
+}
+
+static void check(float temperature)
+{
+    static char plain[N_PROMPTS][TEXT_RING_MAX_UTTERANCE + 1];
+    double plain_s = run(temperature, 0);
+    int plain_completed = completed;
+    memcpy(plain, texts, sizeof(plain));
+    double speculative_s = run(temperature, SPEC_MAX_DRAFT);
+    if (completed != N_PROMPTS || plain_completed != N_PROMPTS)
+    {
+        printf("  FAIL T=%.2f: %d and %d of %d utterances completed\n", temperature, plain_completed, completed,
+               N_PROMPTS);
+        failures++;
+        return;
+    }
+    int differ = 0;
+    for (int i = 0; i < N_PROMPTS; i++)
+    {
+        if (strcmp(plain[i], texts[i]) != 0)
+        {
+            printf("  FAIL T=%.2f, prompt \"%s\":\n    plain:       %s\n    speculative: %s\n", temperature,
+                   prompts[i], plain[i], texts[i]);
+            differ++;
+        }
+    }
+    failures += differ;
+    printf("T=%.2f: %d of %d utterances match, plain %.2f s, %d token drafts %.2f s\n", temperature,
+           N_PROMPTS - differ, N_PROMPTS, plain_s, SPEC_MAX_DRAFT, speculative_s);
+}
+
+int main(void)
+{
+    build_transformer(&transformer, DALEK_DATA_DIR "/tiny_dalek.bin");
+    build_tokenizer(&tokenizer, DALEK_DATA_DIR "/tok512.blob", transformer.config.vocab_size);
+
+    check(0.0f);
+    check(0.25f);
+    check(1.0f);
+
+    free_tokenizer(&tokenizer);
+    free_transformer(&transformer);
+    printf(failures ? "%d checks FAILED\n" : "all checks passed\n", failures);
+    return failures != 0;
+}
@@ -0,0 +1,62 @@
+// The qsort based top-p sampler that sample_topp() replaced, kept unchanged as the reference
+// for the histogram version. It takes normalized probabilities.
+#pragma once
+#include <stdlib.h>
+#include "llm.h"
+
+static int reference_compare(const void *a, const void *b)
+{
+    ProbIndex *a_ = (ProbIndex *)a;
+    ProbIndex *b_ = (ProbIndex *)b;
+    if (a_->prob > b_->prob)
+        return -1;
+    if (a_->prob < b_->prob)
+        return 1;
+    return 0;
+}
+
+static int reference_sample_topp(v4sf *probabilities, int n, float topp, ProbIndex *probindex, v4sf coin)
+{
+    int n0 = 0;
+    const v4sf cutoff = (1.0f - topp) / (n - 1);
+    for (int i = 0; i < n; i++)
+    {
+        if (probabilities[i] >= cutoff)
+        {
+            probindex[n0].index = i;
+            probindex[n0].prob = probabilities[i];
+            n0++;
+        }
+    }
+    qsort(probindex, n0, sizeof(ProbIndex), reference_compare);
+
+    v4sf cumulative_prob = 0.0f;
+    int last_idx = n0 - 1;
+    for (int i = 0; i < n0; i++)
+    {
+        cumulative_prob += probindex[i].prob;
+        if (cumulative_prob > topp)
+        {
+            last_idx = i;
+            break;
+        }
+    }
+
+    v4sf r = coin * cumulative_prob;
+    v4sf cdf = 0.0f;
+    for (int i = 0; i <= last_idx; i++)
+    {
+        cdf += probindex[i].prob;
+        if (r < cdf)
+        {
+            return probindex[i].index;
+        }
+    }
+    return probindex[last_idx].index;
+}
+
+// sampler internals from llm.c that llm.h doesn't export
+void softmax(v4sf *x, int size);
+v4sf softmax_unnormalized(v4sf *x, int size, v4sf inv_temperature);
+v4sf random_f32(unsigned long long *state);
+int sample_topp(v4sf *probabilities, int n, float topp, v4sf mass, Sampler *sampler, v4sf coin);
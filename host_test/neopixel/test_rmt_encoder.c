@@ -0,0 +1,241 @@
+// Checks the IDF 5 NeoPixel encoder, which looks pixel bytes up in the levels table a chunk at a
+// time, against the plain bytes encoder run once over the whole looked-up frame. The test plays
+// the RMT driver: it calls the encoder with as much room as the channel memory has left, so a
+// frame can be cut after any symbol, in the middle of a chunk, on a chunk boundary, or where the
+// bytes encoder finishes a chunk and fills the memory in the same call.
+#include <stdio.h>
+#include <string.h>
+#include "Arduino.h"
+#include "driver/rmt_tx.h"
+
+#define MAX_BYTES (4 * 32 + 1)     // a few ADAFRUIT_RMT_CHUNKs
+#define MAX_SYMBOLS (MAX_BYTES * 8) // one symbol per bit
+#define UNLIMITED ((size_t)-1)
+
+int espBegin(uint8_t pin, boolean is800KHz);
+void espEnd(int handle);
+void espShowAsync(int handle, uint8_t *pixels, uint32_t numBytes, const uint8_t *levels);
+
+// the channel memory: symbols written since the frame started, and room until the next refill.
+// twice the longest frame, so an encoder that repeats itself is caught before it overruns
+static rmt_symbol_word_t sent[2 * MAX_SYMBOLS];
+static rmt_symbol_word_t *out = sent;
+static size_t n_sent, room;
+
+// bit timings the strip's bytes encoder was created with
+static rmt_bytes_encoder_config_t strip_config;
+
+// the transmission rmt_transmit() was asked for
+static rmt_encoder_t *frame_encoder;
+static const void *frame_pixels;
+static size_t frame_bytes;
+
+static int failures;
+
+// stand-in for the driver's bytes encoder: keeps its place across calls, and like the real one
+// reports COMPLETE and MEM_FULL together when its last symbol takes the last free word
+typedef struct
+{
+    rmt_encoder_t base;
+    rmt_bytes_encoder_config_t config;
+    size_t bit; // next bit of the data to encode
+} BytesEncoder;
+
+static size_t bytes_encode(rmt_encoder_t *encoder, rmt_channel_handle_t channel, const void *data, size_t size,
+                           rmt_encode_state_t *ret_state)
+{
+    BytesEncoder *bytes = __containerof(encoder, BytesEncoder, base);
+    const uint8_t *p = data;
+    size_t encoded = 0;
+    int state = RMT_ENCODING_RESET;
+    while (bytes->bit < size * 8 && room > 0)
+    {
+        int shift = bytes->config.flags.msb_first ? 7 - bytes->bit % 8 : bytes->bit % 8;
+        out[n_sent++] = (p[bytes->bit / 8] >> shift) & 1 ? bytes->config.bit1 : bytes->config.bit0;
+        room--;
+        bytes->bit++;
+        encoded++;
+    }
+    if (bytes->bit == size * 8)
+    {
+        bytes->bit = 0;
+        state |= RMT_ENCODING_COMPLETE;
+    }
+    if (room == 0)
+        state |= RMT_ENCODING_MEM_FULL;
+    *ret_state = state;
+    return encoded;
+}
+
+static esp_err_t bytes_reset(rmt_encoder_t *encoder)
+{
+    __containerof(encoder, BytesEncoder, base)->bit = 0;
+    return ESP_OK;
+}
+
+static esp_err_t bytes_del(rmt_encoder_t *encoder)
+{
+    free(__containerof(encoder, BytesEncoder, base));
+    return ESP_OK;
+}
+
+esp_err_t rmt_new_bytes_encoder(const rmt_bytes_encoder_config_t *config, rmt_encoder_handle_t *ret_encoder)
+{
+    BytesEncoder *bytes = calloc(1, sizeof(BytesEncoder));
+    bytes->base = (rmt_encoder_t){bytes_encode, bytes_reset, bytes_del};
+    bytes->config = *config;
+    strip_config = *config;
+    *ret_encoder = &bytes->base;
+    return ESP_OK;
+}
+
+esp_err_t rmt_encoder_reset(rmt_encoder_handle_t encoder) { return encoder->reset(encoder); }
+esp_err_t rmt_del_encoder(rmt_encoder_handle_t encoder) { return encoder->del(encoder); }
+
+esp_err_t rmt_new_tx_channel(const rmt_tx_channel_config_t *config, rmt_channel_handle_t *ret_chan)
+{
+    *ret_chan = (rmt_channel_handle_t)(intptr_t)(config->gpio_num + 1);
+    return ESP_OK;
+}
+
+esp_err_t rmt_tx_register_event_callbacks(rmt_channel_handle_t tx_channel, const rmt_tx_event_callbacks_t *cbs,
+                                          void *user_data)
+{
+    return ESP_OK;
+}
+
+esp_err_t rmt_enable(rmt_channel_handle_t channel) { return ESP_OK; }
+esp_err_t rmt_disable(rmt_channel_handle_t channel) { return ESP_OK; }
+esp_err_t rmt_del_channel(rmt_channel_handle_t channel) { return ESP_OK; }
+esp_err_t rmt_tx_wait_all_done(rmt_channel_handle_t tx_channel, int timeout_ms) { return ESP_OK; }
+
+esp_err_t rmt_transmit(rmt_channel_handle_t tx_channel, rmt_encoder_handle_t encoder, const void *payload,
+                       size_t payload_bytes, const rmt_transmit_config_t *config)
+{
+    frame_encoder = encoder;
+    frame_pixels = payload;
+    frame_bytes = payload_bytes;
+    return ESP_OK;
+}
+
+// what the bytes encoder makes of the whole frame looked up at once, the unchunked way
+static size_t reference(const uint8_t *pixels, size_t n, const uint8_t *levels, rmt_symbol_word_t *symbols)
+{
+    uint8_t looked_up[MAX_BYTES];
+    for (size_t i = 0; i < n; i++)
+        looked_up[i] = levels[pixels[i]];
+    BytesEncoder bytes = {.config = strip_config};
+    out = symbols;
+    n_sent = 0;
+    room = UNLIMITED;
+    rmt_encode_state_t state;
+    size_t encoded = bytes_encode(&bytes.base, NULL, looked_up, n, &state);
+    out = sent;
+    return encoded;
+}
+
+// sends the frame started by espShowAsync(): first room symbols, then refill at every MEM_FULL
+static void transmit(const char *name, const uint8_t *levels, size_t first, size_t refill)
+{
+    rmt_symbol_word_t expected[MAX_SYMBOLS];
+    size_t n_expected = reference(frame_pixels, frame_bytes, levels, expected);
+    n_sent = 0;
+    room = first;
+    size_t encoded = 0;
+    for (int calls = 0;; calls++)
+    {
+        rmt_encode_state_t state = RMT_ENCODING_RESET;
+        size_t before = n_sent;
+        size_t n = frame_encoder->encode(frame_encoder, NULL, frame_pixels, frame_bytes, &state);
+        encoded += n;
+        if (n != n_sent - before)
+        {
+            printf("  FAIL %s: returned %zu symbols, wrote %zu (bytes %zu, room %zu/%zu)\n", name, n,
+                   n_sent - before, frame_bytes, first, refill);
+            failures++;
+            return;
+        }
+        if (n_sent > n_expected)
+        {
+            printf("  FAIL %s: more symbols than the frame has (bytes %zu, room %zu/%zu)\n", name, frame_bytes,
+                   first, refill);
+            failures++;
+            return;
+        }
+        if (state & RMT_ENCODING_COMPLETE)
+            break;
+        if (!(state & RMT_ENCODING_MEM_FULL) || calls > MAX_SYMBOLS)
+        {
+            printf("  FAIL %s: stuck at symbol %zu (bytes %zu, room %zu/%zu)\n", name, n_sent, frame_bytes,
+                   first, refill);
+            failures++;
+            return;
+        }
+        room = refill;
+    }
+    if (encoded != n_expected || memcmp(sent, expected, n_expected * sizeof(*expected)) != 0)
+    {
+        size_t at = 0;
+        while (at < n_expected && at < encoded && sent[at].val == expected[at].val)
+            at++;
+        printf("  FAIL %s: %zu of %zu symbols, first difference at %zu (bytes %zu, room %zu/%zu)\n", name,
+               encoded, n_expected, at, frame_bytes, first, refill);
+        failures++;
+    }
+}
+
+int main(void)
+{
+    uint8_t pixels[MAX_BYTES], levels[256];
+    for (int i = 0; i < 256; i++)
+        levels[i] = (uint8_t)(i * 77 + 3); // a permutation, so a skipped lookup shows
+    srand(1);
+    for (int i = 0; i < MAX_BYTES; i++)
+        pixels[i] = (uint8_t)rand();
+
+    const boolean speeds[] = {true, false};
+    const char *names[] = {"800 kHz", "400 kHz"};
+    for (int s = 0; s < 2; s++)
+    {
+        int handle = espBegin(5, speeds[s]);
+        int checks = failures;
+
+        // cut once, after every symbol of frames around the chunk size
+        const size_t lengths[] = {1, 2, 31, 32, 33, 64, 65, 100};
+        for (size_t l = 0; l < sizeof(lengths) / sizeof(lengths[0]); l++)
+        {
+            for (size_t cut = 1; cut < lengths[l] * 8; cut++)
+            {
+                espShowAsync(handle, pixels, lengths[l], levels);
+                transmit(names[s], levels, cut, UNLIMITED);
+            }
+        }
+
+        // refilled over and over, every memory size against every frame length up to four chunks:
+        // 8 symbols ends each call on a byte, 256 on a chunk
+        for (size_t n = 0; n <= MAX_BYTES; n++)
+        {
+            for (size_t mem = 1; mem <= 300; mem++)
+            {
+                espShowAsync(handle, pixels, n, levels);
+                transmit(names[s], levels, mem, mem);
+            }
+        }
+
+        // a frame dropped halfway, e.g. by rmt_disable(), and reset: the next starts clean
+        espShowAsync(handle, pixels, 100, levels);
+        n_sent = 0;
+        room = 300;
+        rmt_encode_state_t state;
+        frame_encoder->encode(frame_encoder, NULL, frame_pixels, frame_bytes, &state);
+        frame_encoder->reset(frame_encoder);
+        espShowAsync(handle, pixels + 7, 90, levels);
+        transmit(names[s], levels, UNLIMITED, UNLIMITED);
+
+        printf("%s: %s\n", names[s], failures == checks ? "symbols match" : "symbols differ");
+        espEnd(handle);
+    }
+
+    printf(failures ? "%d checks FAILED\n" : "all checks passed\n", failures);
+    return failures != 0;
+}
@@ -0,0 +1,180 @@
+// Runs asynchronous Stepper moves on a simulated esp_timer and checks the step timestamps
+// against the trapezoidal profile: never faster than the setSpeed() speed, speeding up
+// monotonically and braking as the mirror image of it, and exactly the asked number of steps,
+// also for short moves that brake before they ever reach cruise speed.
+#include <stdio.h>
+#include <stdlib.h>
+#include <vector>
+#include "Arduino.h"
+#include "Stepper.h"
+
+#define STEPS_PER_REV 2048
+#define RPM 10
+#define ACCELERATION 800                                 // steps/s^2, as the dome
+#define STEP_US (60L * 1000 * 1000 / STEPS_PER_REV / RPM) // cruise interval, the speed cap
+#define CRUISE_STEPS 72 // steps of a move before it reaches cruise speed, about v^2 / 2a
+
+struct HostTimer
+{
+    esp_timer_cb_t callback;
+    void *arg;
+    int64_t due;
+    bool armed;
+};
+
+static HostTimer timer;
+static int64_t now_us;
+static int failures;
+
+esp_err_t esp_timer_create(const esp_timer_create_args_t *args, esp_timer_handle_t *handle)
+{
+    timer.callback = args->callback;
+    timer.arg = args->arg;
+    *handle = &timer;
+    return ESP_OK;
+}
+
+esp_err_t esp_timer_start_once(esp_timer_handle_t t, uint64_t timeout_us)
+{
+    t->due = now_us + timeout_us;
+    t->armed = true;
+    return ESP_OK;
+}
+
+void pinMode(uint8_t pin, uint8_t mode) {}
+void digitalWrite(uint8_t pin, uint8_t val) {}
+unsigned long micros(void) { return now_us; }
+void delay(uint32_t ms) { now_us += ms * 1000; }
+
+static void fail(const char *name, const char *what, long at)
+{
+    printf("  FAIL %s: %s (at %ld)\n", name, what, at);
+    failures++;
+}
+
+// fires the timer until the motor goes idle and returns when each step was taken
+static std::vector<int64_t> run(Stepper &stepper)
+{
+    std::vector<int64_t> stamps;
+    long position = stepper.currentPosition();
+    while (timer.armed)
+    {
+        timer.armed = false;
+        now_us = timer.due;
+        timer.callback(timer.arg);
+        if (stepper.currentPosition() != position)
+        {
+            stamps.push_back(now_us);
+            position = stepper.currentPosition();
+        }
+    }
+    return stamps;
+}
+
+// one move from standstill to standstill: intervals fall to their minimum, then rise again as
+// its mirror image, and never get shorter than the cruise interval
+static void check_profile(const char *name, const std::vector<int64_t> &stamps, long steps, bool cruises,
+                          bool print = true)
+{
+    if ((long)stamps.size() != labs(steps))
+    {
+        fail(name, "wrong number of steps", (long)stamps.size());
+        return;
+    }
+    long n = (long)stamps.size() - 1; // intervals
+    long fastest = STEP_US * 100;
+    for (long i = 0; i < n; i++)
+    {
+        int64_t dt = stamps[i + 1] - stamps[i];
+        if (dt < STEP_US)
+            fail(name, "faster than the speed cap", i);
+        if (dt < fastest)
+            fastest = dt;
+        if (dt != stamps[n - i] - stamps[n - i - 1])
+            fail(name, "braking doesn't mirror accelerating", i);
+        if (i > 0 && i <= n / 2 && dt > stamps[i] - stamps[i - 1])
+            fail(name, "slows down while accelerating", i);
+    }
+    if (n > 0 && cruises != (fastest == STEP_US))
+        fail(name, cruises ? "never reaches cruise speed" : "reaches cruise speed", fastest);
+    if (print)
+        printf("%-24s %5ld steps in %7ld us, fastest interval %ld us\n", name, (long)stamps.size(),
+               stamps.empty() ? 0L : (long)(stamps.back() - stamps.front()), n > 0 ? fastest : 0L);
+}
+
+int main(void)
+{
+    Stepper stepper(STEPS_PER_REV, 5, 19, 18, 21);
+    stepper.setSpeed(RPM);
+    stepper.setAcceleration(ACCELERATION);
+    EventGroupHandle_t idle = xEventGroupCreate();
+    stepper.setIdleEvent(idle, 1);
+
+    // every short move, both ways: brakes before reaching cruise speed, still lands exactly
+    char name[32];
+    for (long steps = 1; steps < 2 * CRUISE_STEPS; steps++)
+    {
+        for (int sign = 1; sign >= -1; sign -= 2)
+        {
+            long target = stepper.currentPosition() + sign * steps;
+            stepper.moveAsync(sign * steps);
+            std::vector<int64_t> stamps = run(stepper);
+            snprintf(name, sizeof(name), "short %+ld", sign * steps);
+            if (stepper.currentPosition() != target)
+                fail(name, "stopped off target", stepper.currentPosition());
+            check_profile(name, stamps, steps, false, steps % 20 == 1);
+        }
+    }
+
+    // long moves accelerate, cruise at the cap and brake
+    const long long_moves[] = {2 * CRUISE_STEPS + 10, 500, -STEPS_PER_REV};
+    for (long steps : long_moves)
+    {
+        long target = stepper.currentPosition() + steps;
+        stepper.moveAsync(steps);
+        snprintf(name, sizeof(name), "long %+ld", steps);
+        check_profile(name, run(stepper), steps, true);
+        if (stepper.currentPosition() != target)
+            fail(name, "stopped off target", stepper.currentPosition());
+    }
+
+    // queued moves each run their own profile, and the motor reports idle once all are done
+    long start = stepper.currentPosition();
+    stepper.moveAsync(300);
+    stepper.moveAsync(-100);
+    if (xEventGroupGetBits(idle) & 1)
+        fail("queued", "idle while moving", 0);
+    std::vector<int64_t> stamps = run(stepper);
+    if (stamps.size() == 400)
+    {
+        check_profile("queued +300", std::vector<int64_t>(stamps.begin(), stamps.begin() + 300), 300, true);
+        check_profile("queued -100", std::vector<int64_t>(stamps.begin() + 300, stamps.end()), 100, false);
+    }
+    else
+        fail("queued", "wrong number of steps", (long)stamps.size());
+    if (stepper.currentPosition() != start + 200 || stepper.isBusy() || !(xEventGroupGetBits(idle) & 1))
+        fail("queued", "not idle on the last target", stepper.currentPosition());
+
+    // blocking steps between asynchronous moves: the next move starts where step() left the
+    // motor, and step() keeps off a motor the timer is driving
+    long before = stepper.currentPosition();
+    stepper.step(25);
+    stepper.moveTo(before + 50);
+    stepper.step(5);
+    check_profile("after step()", run(stepper), 25, false);
+    if (stepper.currentPosition() != before + 50)
+        fail("after step()", "stopped off target", stepper.currentPosition());
+
+    // without an acceleration every step comes at the cruise interval
+    stepper.setAcceleration(0);
+    stepper.moveAsync(50);
+    stamps = run(stepper);
+    if (stamps.size() != 50)
+        fail("constant speed", "wrong number of steps", (long)stamps.size());
+    for (size_t i = 1; i < stamps.size(); i++)
+        if (stamps[i] - stamps[i - 1] != STEP_US)
+            fail("constant speed", "interval off the cruise interval", (long)i);
+
+    printf(failures ? "%d checks FAILED\n" : "all checks passed\n", failures);
+    return failures != 0;
+}
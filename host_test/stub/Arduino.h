@@ -0,0 +1,25 @@
+#pragma once
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include "esp_attr.h"
+#include "esp_err.h"
+#include "esp_idf_version.h"
+#include "freertos/FreeRTOS.h"
+#ifdef __cplusplus
+extern "C" {
+#endif
+// the pin and clock calls are left to the test, which decides what time it is
+#define HIGH 1
+#define LOW 0
+#define OUTPUT 0x03
+typedef bool boolean;
+#define log_e(format, ...) fprintf(stderr, format "\n", ##__VA_ARGS__)
+void pinMode(uint8_t pin, uint8_t mode);
+void digitalWrite(uint8_t pin, uint8_t val);
+unsigned long micros(void);
+void delay(uint32_t ms);
+#ifdef __cplusplus
+}
+#endif
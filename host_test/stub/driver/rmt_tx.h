@@ -0,0 +1,47 @@
+#pragma once
+#include <stdbool.h>
+#include "driver/rmt_encoder.h"
+#ifdef __cplusplus
+extern "C" {
+#endif
+#define RMT_CLK_SRC_DEFAULT 0
+
+typedef struct
+{
+    int gpio_num;
+    int clk_src;
+    uint32_t resolution_hz;
+    size_t mem_block_symbols;
+    size_t trans_queue_depth;
+} rmt_tx_channel_config_t;
+
+typedef struct
+{
+    size_t num_symbols;
+} rmt_tx_done_event_data_t;
+
+typedef bool (*rmt_tx_done_callback_t)(rmt_channel_handle_t tx_chan, const rmt_tx_done_event_data_t *edata,
+                                       void *user_ctx);
+typedef struct
+{
+    rmt_tx_done_callback_t on_trans_done;
+} rmt_tx_event_callbacks_t;
+
+typedef struct
+{
+    int loop_count;
+} rmt_transmit_config_t;
+
+// left to the test, which plays the driver
+esp_err_t rmt_new_tx_channel(const rmt_tx_channel_config_t *config, rmt_channel_handle_t *ret_chan);
+esp_err_t rmt_tx_register_event_callbacks(rmt_channel_handle_t tx_channel, const rmt_tx_event_callbacks_t *cbs,
+                                          void *user_data);
+esp_err_t rmt_enable(rmt_channel_handle_t channel);
+esp_err_t rmt_disable(rmt_channel_handle_t channel);
+esp_err_t rmt_del_channel(rmt_channel_handle_t channel);
+esp_err_t rmt_transmit(rmt_channel_handle_t tx_channel, rmt_encoder_handle_t encoder, const void *payload,
+                       size_t payload_bytes, const rmt_transmit_config_t *config);
+esp_err_t rmt_tx_wait_all_done(rmt_channel_handle_t tx_channel, int timeout_ms);
+#ifdef __cplusplus
+}
+#endif
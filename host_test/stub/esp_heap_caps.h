@@ -0,0 +1,15 @@
+#pragma once
+#include <stdlib.h>
+#define MALLOC_CAP_32BIT (1 << 1)
+#define MALLOC_CAP_8BIT (1 << 2)
+#define MALLOC_CAP_SPIRAM (1 << 10)
+#define MALLOC_CAP_INTERNAL (1 << 11)
+#define MALLOC_CAP_DEFAULT (1 << 12)
+static inline void *heap_caps_malloc(size_t size, unsigned caps) { (void)caps; return malloc(size); }
+static inline void *heap_caps_calloc(size_t n, size_t size, unsigned caps) { (void)caps; return calloc(n, size); }
+static inline void *heap_caps_realloc(void *ptr, size_t size, unsigned caps) { (void)caps; return realloc(ptr, size); }
+static inline void heap_caps_free(void *ptr) { free(ptr); }
+static inline size_t heap_caps_get_free_size(unsigned caps) { (void)caps; return 4 << 20; }
+static inline size_t heap_caps_get_largest_free_block(unsigned caps) { (void)caps; return 2 << 20; }
+static inline size_t heap_caps_get_minimum_free_size(unsigned caps) { (void)caps; return 2 << 20; }
+static inline size_t heap_caps_get_total_size(unsigned caps) { (void)caps; return 4 << 20; }
@@ -0,0 +1,4 @@
+#pragma once
+// the stubs follow the IDF 5 driver API, e.g. driver/rmt_tx.h
+#define ESP_IDF_VERSION_VAL(major, minor, patch) (((major) << 16) | ((minor) << 8) | (patch))
+#define ESP_IDF_VERSION ESP_IDF_VERSION_VAL(5, 1, 0)
@@ -0,0 +1,14 @@
+#pragma once
+#include <stdint.h>
+// same polynomial and inversion as the ROM (and zlib's crc32)
+static inline uint32_t esp_rom_crc32_le(uint32_t crc, const uint8_t *buf, uint32_t len)
+{
+    crc = ~crc;
+    while (len--)
+    {
+        crc ^= *buf++;
+        for (int k = 0; k < 8; k++)
+            crc = (crc >> 1) ^ (0xedb88320u & -(crc & 1));
+    }
+    return ~crc;
+}
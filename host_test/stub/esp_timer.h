@@ -0,0 +1,32 @@
+#pragma once
+#include <stdbool.h>
+#include <stdint.h>
+#include <time.h>
+#include "esp_err.h"
+#ifdef __cplusplus
+extern "C" {
+#endif
+static inline int64_t esp_timer_get_time(void)
+{
+    struct timespec t;
+    clock_gettime(CLOCK_MONOTONIC, &t);
+    return t.tv_sec * 1000000LL + t.tv_nsec / 1000;
+}
+
+// one-shot timers have no host implementation here: a test that needs them defines these and
+// fires the callbacks itself, on its own clock
+typedef void (*esp_timer_cb_t)(void *arg);
+typedef struct HostTimer *esp_timer_handle_t;
+typedef struct
+{
+    esp_timer_cb_t callback;
+    void *arg;
+    int dispatch_method;
+    const char *name;
+    bool skip_unhandled_events;
+} esp_timer_create_args_t;
+esp_err_t esp_timer_create(const esp_timer_create_args_t *args, esp_timer_handle_t *handle);
+esp_err_t esp_timer_start_once(esp_timer_handle_t timer, uint64_t timeout_us);
+#ifdef __cplusplus
+}
+#endif
@@ -0,0 +1,375 @@
+// Stand-ins for the FreeRTOS calls the components link against, each task a pthread. The parts
+// of the scheduler the components rely on are modelled, as on the chip where a higher priority
+// task runs at once on the other core:
+//  - creating a task, or giving a semaphore, first waits for every task of higher priority than
+//    the caller to block, so a new task is waiting for work and a woken one is waiting again
+//  - giving a semaphore a higher priority task waits on hands it straight to that task, so the
+//    giver can't take it back first
+// Everything else runs freely in parallel. One lock guards all the objects and any state change
+// wakes every waiter, which is plenty for a handful of tasks. Blocking forever with no other task
+// left to wake the caller aborts instead of hanging the test.
+#define _GNU_SOURCE
+#include <errno.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include <unistd.h>
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#include "freertos/semphr.h"
+#include "freertos/event_groups.h"
+
+#define MAIN_PRIORITY 1 // app_main's
+
+typedef struct HostTask
+{
+    pthread_t thread;
+    TaskFunction_t function;
+    void *param;
+    char name[configMAX_TASK_NAME_LEN];
+    UBaseType_t priority;
+    BaseType_t core;
+    bool blocked; // waiting in one of the calls below
+    bool deleted; // vTaskDelete() asked it to go at its next blocking call
+    const void *waiting_on; // semaphore or event group it blocks on
+    struct HostTask *next;
+} HostTask;
+
+struct HostSemaphore
+{
+    int count;
+    HostTask *handed_to; // a higher priority waiter given the semaphore, not yet running again
+};
+
+struct HostEventGroup
+{
+    EventBits_t bits;
+    unsigned syncs; // completed xEventGroupSync() rendezvous, releases the tasks waiting in one
+};
+
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t changed = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t blocked = PTHREAD_COND_INITIALIZER; // a task blocked or ended
+static pthread_mutex_t critical = PTHREAD_RECURSIVE_MUTEX_INITIALIZER_NP;
+static HostTask main_task = {.name = "main", .priority = MAIN_PRIORITY};
+static __thread HostTask *current;
+static HostTask *tasks = &main_task; // every task, for xSemaphoreGive() to find the waiters
+static int n_tasks; // created and not yet finished
+
+static void unavailable(const char *what)
+{
+    fprintf(stderr, "%s is not available in the host tests\n", what);
+    abort();
+}
+
+static HostTask *self(void) { return current ? current : &main_task; }
+
+static void exit_task(void)
+{
+    // with the lock held
+    HostTask *task = self();
+    task->blocked = true;
+    n_tasks--;
+    pthread_cond_broadcast(&changed);
+    pthread_cond_broadcast(&blocked);
+    pthread_mutex_unlock(&lock);
+    pthread_exit(NULL);
+}
+
+static struct timespec deadline_after(TickType_t ticks)
+{
+    struct timespec t;
+    clock_gettime(CLOCK_REALTIME, &t);
+    long long ns = t.tv_nsec + (long long)ticks * portTICK_PERIOD_MS * 1000000;
+    t.tv_sec += ns / 1000000000;
+    t.tv_nsec = ns % 1000000000;
+    return t;
+}
+
+// waits with the lock held for any state change, false once ticks have passed since start
+static bool wait_changed(TickType_t ticks, const struct timespec *deadline)
+{
+    HostTask *task = self();
+    if (task->deleted)
+        exit_task();
+    // lets lower priority tasks waiting in yield_to_higher() carry on
+    task->blocked = true;
+    pthread_cond_broadcast(&blocked);
+    bool woken = true;
+    if (ticks == portMAX_DELAY)
+    {
+        if (current == NULL && n_tasks == 0)
+            unavailable("blocking with no other task to wake the caller");
+        pthread_cond_wait(&changed, &lock);
+    }
+    else
+        woken = pthread_cond_timedwait(&changed, &lock, deadline) != ETIMEDOUT;
+    task->blocked = false;
+    if (task->deleted)
+        exit_task();
+    return woken;
+}
+
+// with the lock held: the tasks blocked on object count as running again from here, not only
+// once their threads get the lock back, so yield_to_higher() waits for them to block again
+static void wake(const void *object)
+{
+    for (HostTask *task = tasks; task; task = task->next)
+    {
+        if (task->waiting_on == object)
+            task->blocked = false;
+    }
+    pthread_cond_broadcast(&changed);
+}
+
+// waits with the lock held until every task of higher priority than the caller is blocked
+static void yield_to_higher(void)
+{
+    HostTask *caller = self();
+    for (;;)
+    {
+        bool running = false;
+        for (HostTask *task = tasks; task; task = task->next)
+            running |= task != caller && task->priority > caller->priority && !task->blocked;
+        if (!running)
+            return;
+        pthread_cond_wait(&blocked, &lock);
+    }
+}
+
+static void *run_task(void *arg)
+{
+    current = arg;
+    current->function(current->param);
+    // returning from a task function is an error on the chip, here it just ends the task
+    pthread_mutex_lock(&lock);
+    exit_task();
+    return NULL;
+}
+
+BaseType_t xTaskCreatePinnedToCore(TaskFunction_t function, const char *name, uint32_t stack, void *param,
+                                   UBaseType_t priority, TaskHandle_t *handle, BaseType_t core)
+{
+    (void)stack;
+    HostTask *task = calloc(1, sizeof(HostTask));
+    task->function = function;
+    task->param = param;
+    snprintf(task->name, sizeof(task->name), "%s", name);
+    task->priority = priority;
+    task->core = core == tskNO_AFFINITY ? 0 : core;
+    if (handle)
+        *handle = task;
+    pthread_mutex_lock(&lock);
+    task->next = tasks;
+    tasks = task;
+    n_tasks++;
+    pthread_create(&task->thread, NULL, run_task, task);
+    yield_to_higher();
+    pthread_mutex_unlock(&lock);
+    return pdPASS;
+}
+
+BaseType_t xTaskCreate(TaskFunction_t function, const char *name, uint32_t stack, void *param, UBaseType_t priority,
+                       TaskHandle_t *handle)
+{
+    return xTaskCreatePinnedToCore(function, name, stack, param, priority, handle, tskNO_AFFINITY);
+}
+
+void vTaskDelete(TaskHandle_t handle)
+{
+    HostTask *task = handle ? handle : self();
+    if (task == &main_task)
+        unavailable("deleting the main task");
+    pthread_mutex_lock(&lock);
+    if (task == current)
+        exit_task();
+    // it goes at its next blocking call, which for the components' tasks is where they wait for work
+    task->deleted = true;
+    pthread_cond_broadcast(&changed);
+    pthread_mutex_unlock(&lock);
+    pthread_join(task->thread, NULL);
+    pthread_mutex_lock(&lock);
+    HostTask **link = &tasks;
+    while (*link != task)
+        link = &(*link)->next;
+    *link = task->next;
+    pthread_mutex_unlock(&lock);
+    free(task);
+}
+
+void vTaskDelay(TickType_t ticks)
+{
+    if (ticks == 0)
+        sched_yield();
+    else
+        usleep(ticks * portTICK_PERIOD_MS * 1000);
+    if (self()->deleted)
+    {
+        pthread_mutex_lock(&lock);
+        exit_task();
+    }
+}
+
+TaskHandle_t xTaskGetCurrentTaskHandle(void) { return self(); }
+
+char *pcTaskGetName(TaskHandle_t handle) { return ((HostTask *)(handle ? handle : self()))->name; }
+
+TickType_t xTaskGetTickCount(void)
+{
+    struct timespec t;
+    clock_gettime(CLOCK_MONOTONIC, &t);
+    return (TickType_t)(t.tv_sec * 1000 / portTICK_PERIOD_MS + t.tv_nsec / 1000000 / portTICK_PERIOD_MS);
+}
+
+BaseType_t xPortGetCoreID(void) { return self()->core; }
+
+void host_enter_critical(void) { pthread_mutex_lock(&critical); }
+void host_exit_critical(void) { pthread_mutex_unlock(&critical); }
+
+SemaphoreHandle_t xSemaphoreCreateBinary(void) { return calloc(1, sizeof(struct HostSemaphore)); }
+
+SemaphoreHandle_t xSemaphoreCreateMutex(void)
+{
+    SemaphoreHandle_t sem = xSemaphoreCreateBinary();
+    sem->count = 1;
+    return sem;
+}
+
+BaseType_t xSemaphoreGive(SemaphoreHandle_t sem)
+{
+    pthread_mutex_lock(&lock);
+    yield_to_higher();
+    if (sem->count || sem->handed_to)
+    {
+        pthread_mutex_unlock(&lock);
+        return pdFALSE;
+    }
+    // the highest priority task waiting for it, if that outranks the caller
+    HostTask *waiter = NULL;
+    for (HostTask *task = tasks; task; task = task->next)
+    {
+        if (task->waiting_on == sem && (waiter == NULL || task->priority > waiter->priority))
+            waiter = task;
+    }
+    if (waiter && waiter->priority > self()->priority)
+        sem->handed_to = waiter;
+    else
+        sem->count = 1;
+    wake(sem);
+    pthread_mutex_unlock(&lock);
+    return pdTRUE;
+}
+
+BaseType_t xSemaphoreTake(SemaphoreHandle_t sem, TickType_t ticks)
+{
+    HostTask *task = self();
+    struct timespec deadline = deadline_after(ticks);
+    pthread_mutex_lock(&lock);
+    BaseType_t taken = pdTRUE;
+    task->waiting_on = sem;
+    while (sem->handed_to != task && (sem->count == 0 || sem->handed_to))
+    {
+        if (!wait_changed(ticks, &deadline))
+        {
+            taken = pdFALSE;
+            break;
+        }
+    }
+    task->waiting_on = NULL;
+    if (taken)
+    {
+        if (sem->handed_to == task)
+            sem->handed_to = NULL;
+        else
+            sem->count = 0;
+    }
+    pthread_mutex_unlock(&lock);
+    return taken;
+}
+
+void vSemaphoreDelete(SemaphoreHandle_t sem) { free(sem); }
+
+EventGroupHandle_t xEventGroupCreate(void) { return calloc(1, sizeof(struct HostEventGroup)); }
+
+EventBits_t xEventGroupSync(EventGroupHandle_t group, EventBits_t set, EventBits_t wait, TickType_t ticks)
+{
+    struct timespec deadline = deadline_after(ticks);
+    pthread_mutex_lock(&lock);
+    group->bits |= set;
+    EventBits_t bits = group->bits;
+    if ((group->bits & wait) == wait)
+    {
+        // the last one to arrive releases the others
+        group->bits &= ~wait;
+        group->syncs++;
+        wake(group);
+    }
+    else
+    {
+        HostTask *task = self();
+        unsigned syncs = group->syncs;
+        task->waiting_on = group;
+        while (group->syncs == syncs)
+        {
+            if (!wait_changed(ticks, &deadline))
+                break;
+        }
+        task->waiting_on = NULL;
+        bits = group->syncs == syncs ? group->bits : wait;
+    }
+    pthread_mutex_unlock(&lock);
+    return bits;
+}
+
+EventBits_t xEventGroupClearBits(EventGroupHandle_t group, EventBits_t bits)
+{
+    pthread_mutex_lock(&lock);
+    EventBits_t old = group->bits;
+    group->bits &= ~bits;
+    pthread_mutex_unlock(&lock);
+    return old;
+}
+
+EventBits_t xEventGroupSetBits(EventGroupHandle_t group, EventBits_t bits)
+{
+    pthread_mutex_lock(&lock);
+    group->bits |= bits;
+    EventBits_t now = group->bits;
+    wake(group);
+    pthread_mutex_unlock(&lock);
+    return now;
+}
+
+EventBits_t xEventGroupWaitBits(EventGroupHandle_t group, EventBits_t bits, BaseType_t clear, BaseType_t all,
+                                TickType_t ticks)
+{
+    struct timespec deadline = deadline_after(ticks);
+    pthread_mutex_lock(&lock);
+    HostTask *task = self();
+    bool met;
+    task->waiting_on = group;
+    while (!(met = all ? (group->bits & bits) == bits : (group->bits & bits) != 0))
+    {
+        if (!wait_changed(ticks, &deadline))
+            break;
+    }
+    task->waiting_on = NULL;
+    EventBits_t old = group->bits;
+    if (met && clear)
+        group->bits &= ~bits;
+    pthread_mutex_unlock(&lock);
+    return old;
+}
+
+EventBits_t xEventGroupGetBits(EventGroupHandle_t group)
+{
+    pthread_mutex_lock(&lock);
+    EventBits_t bits = group->bits;
+    pthread_mutex_unlock(&lock);
+    return bits;
+}
+
+void vEventGroupDelete(EventGroupHandle_t group) { free(group); }
@@ -0,0 +1,34 @@
+#pragma once
+#include <stdint.h>
+#include <stddef.h>
+typedef uint32_t TickType_t;
+typedef int BaseType_t;
+typedef unsigned UBaseType_t;
+#define pdTRUE 1
+#define pdFALSE 0
+#define pdPASS 1
+#define portMAX_DELAY 0xffffffffu
+#define portTICK_PERIOD_MS 10
+#define pdMS_TO_TICKS(ms) ((ms) / portTICK_PERIOD_MS)
+#define configMAX_PRIORITIES 25
+#define configMAX_TASK_NAME_LEN 16
+#define portNUM_PROCESSORS 2
+#define tskNO_AFFINITY 0x7fffffff
+// every critical section takes the same host lock, whichever spinlock it names
+#ifdef __cplusplus
+extern "C" {
+#endif
+void host_enter_critical(void);
+void host_exit_critical(void);
+#ifdef __cplusplus
+}
+#endif
+typedef int portMUX_TYPE;
+#define portMUX_INITIALIZER_UNLOCKED 0
+#define portMUX_INITIALIZE(mux) (*(mux) = 0)
+#define portENTER_CRITICAL(mux) ((void)(mux), host_enter_critical())
+#define portEXIT_CRITICAL(mux) ((void)(mux), host_exit_critical())
+#define portENTER_CRITICAL_ISR(mux) portENTER_CRITICAL(mux)
+#define portEXIT_CRITICAL_ISR(mux) portEXIT_CRITICAL(mux)
+#define taskENTER_CRITICAL(mux) portENTER_CRITICAL(mux)
+#define taskEXIT_CRITICAL(mux) portEXIT_CRITICAL(mux)
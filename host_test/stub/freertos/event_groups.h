@@ -0,0 +1,18 @@
+#pragma once
+#include "FreeRTOS.h"
+#ifdef __cplusplus
+extern "C" {
+#endif
+typedef uint32_t EventBits_t;
+typedef struct HostEventGroup *EventGroupHandle_t;
+EventGroupHandle_t xEventGroupCreate(void);
+EventBits_t xEventGroupSync(EventGroupHandle_t group, EventBits_t set, EventBits_t wait, TickType_t ticks);
+EventBits_t xEventGroupClearBits(EventGroupHandle_t group, EventBits_t bits);
+EventBits_t xEventGroupSetBits(EventGroupHandle_t group, EventBits_t bits);
+EventBits_t xEventGroupWaitBits(EventGroupHandle_t group, EventBits_t bits, BaseType_t clear, BaseType_t all,
+                                TickType_t ticks);
+EventBits_t xEventGroupGetBits(EventGroupHandle_t group);
+void vEventGroupDelete(EventGroupHandle_t group);
+#ifdef __cplusplus
+}
+#endif
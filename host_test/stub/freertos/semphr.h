@@ -0,0 +1,8 @@
+#pragma once
+#include "FreeRTOS.h"
+typedef struct HostSemaphore *SemaphoreHandle_t;
+SemaphoreHandle_t xSemaphoreCreateBinary(void);
+SemaphoreHandle_t xSemaphoreCreateMutex(void);
+BaseType_t xSemaphoreGive(SemaphoreHandle_t sem);
+BaseType_t xSemaphoreTake(SemaphoreHandle_t sem, TickType_t ticks);
+void vSemaphoreDelete(SemaphoreHandle_t sem);
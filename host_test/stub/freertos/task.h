@@ -0,0 +1,21 @@
+#pragma once
+#include "FreeRTOS.h"
+#ifdef __cplusplus
+extern "C" {
+#endif
+typedef void *TaskHandle_t;
+typedef void (*TaskFunction_t)(void *);
+BaseType_t xTaskCreatePinnedToCore(TaskFunction_t task, const char *name, uint32_t stack, void *param,
+                                   UBaseType_t priority, TaskHandle_t *handle, BaseType_t core);
+BaseType_t xTaskCreate(TaskFunction_t task, const char *name, uint32_t stack, void *param, UBaseType_t priority,
+                       TaskHandle_t *handle);
+void vTaskDelete(TaskHandle_t handle);
+void vTaskDelay(TickType_t ticks);
+TaskHandle_t xTaskGetCurrentTaskHandle(void);
+char *pcTaskGetName(TaskHandle_t handle);
+TickType_t xTaskGetTickCount(void);
+BaseType_t xPortGetCoreID(void);
+#ifdef __cplusplus
+}
+#endif
+#define taskYIELD() ((void)0)
@@ -0,0 +1,3 @@
+#pragma once
+#define GPIO_OUT_W1TS_REG 0
+#define GPIO_OUT_W1TC_REG 1
@@ -9,30 +9,102 @@
 #include "sdkconfig.h"
 #include "esp_err.h"
 #include "esp_log.h"
+#include "esp_heap_caps.h"
+#include "esp_rom_crc.h"
+#include "esp_timer.h"
 #include <time.h>
+#include <stddef.h>
+#include <unistd.h>
+#include <math.h>
+#include <atomic>
 
 extern "C"
 {
 #include "llm.h"
+#include "mem_telemetry.h"
+#include "trace.h"
 #include "sound.h"
 #include <ESP8266SAM.h>
 }
 
 const int stepsPerRevolution = 2048;  // change this to fit the number of steps per revolution
 static const char *TAG = "MAIN";
-char *text = nullptr;
+char *text = nullptr; // last utterance, points into the llm's text ring
 
 // default parameters
-char *checkpoint_path = "/data/tiny_dalek.bin"; // e.g. out/model.bin
-char *tokenizer_path = "/data/tok512.bin";
+char *tokenizer_path = "/data/tok512.blob";
 float temperature = 0.25f;        // 0.0 = greedy deterministic. 1.0 = original. don't set higher
 float topp = 0.9f;               // top-p in nucleus sampling. 1.0 = off. 0.9 works well, but slower
 int steps = 128;                 // number of steps to run for
+int max_draft = 4;               // tokens proposed per speculative step, 0 = off
+int draft_ngram = 3;             // longest n-gram the drafter matches against
+char *phrases_path = NULL;       // optional phrase table for the drafter, one phrase per line
 unsigned long long rng_seed = 0; // seed rng with time by default
-int32_t stepper_pos = 0;         // initial position of stepper motor
-
-TaskHandle_t stepperTask = NULL;
-TaskHandle_t ledsTask = NULL;
+bool trace_enabled = false;      // record a timeline and print it as Chrome trace JSON after each utterance
+
+TaskHandle_t animationTask = NULL;
+TaskHandle_t ledEngineTask = NULL;
+TaskHandle_t generatorTask = NULL;
+
+// boot runs as a small dependency graph, every stage sets its bit in boot_events when done
+enum BootStage {
+    BOOT_STORAGE,   // SPIFFS mounted
+    BOOT_OUTPUTS,   // LEDs and stepper
+    BOOT_CACHE,     // utterances restored from flash, needs storage
+    BOOT_TOKENIZER, // with the sampler and drafter, needs storage
+    BOOT_MODEL,     // checkpoint, weights and RunState, needs storage
+    BOOT_STAGES
+};
+#define BOOT_BIT(stage) (1 << (stage))
+#define BOOT_ALL ((1 << BOOT_STAGES) - 1)
+
+const char *boot_stage_names[BOOT_STAGES] = {"storage", "outputs", "cache", "tokenizer", "model"};
+int64_t boot_stage_us[BOOT_STAGES][2]; // start and end, since power on
+EventGroupHandle_t boot_events;
+
+#define UTTERANCE_QUEUE_LEN 2 // utterances kept ready; the text ring keeps 3 alive past the one being spoken
+#define SAY_CHUNK_LEN 64      // characters per SAM call
+#define UTTERANCE_CHUNKS ((TEXT_RING_MAX_UTTERANCE + SAY_CHUNK_LEN - 1) / SAY_CHUNK_LEN)
+
+// an utterance generated ahead of time, with its phonemes so SAM only has to render it
+struct Utterance {
+    char *text;             // points into the llm's text ring
+    uint32_t random_number; // picked the prompt, and drives the animation
+    int n_chunks;
+    bool phonetic[UTTERANCE_CHUNKS]; // false if the chunk couldn't be converted and holds text
+    char chunks[UTTERANCE_CHUNKS][256];
+};
+
+// slots cycle free -> generator -> ready -> speaker -> free. one is being spoken, one being
+// generated, the rest queued, so the generator never runs more than 3 utterances ahead
+Utterance *utterances = nullptr; // PSRAM if there is any, the phonemes of a full length utterance take 4k
+QueueHandle_t free_utterances;
+QueueHandle_t ready_utterances;
+SemaphoreHandle_t sam_lock; // SAM's globals are shared by Say and Phonemize
+
+// the last few utterances survive a reboot, so the first trigger is answered before the model loads
+#define UTTERANCE_CACHE_PATH "/data/utterances.bin"
+#define UTTERANCE_CACHE_TMP "/data/utterances.tmp"
+#define UTTERANCE_CACHE_MAGIC 0x32435455 // "UTC2", bump when the layout below changes
+#define UTTERANCE_CACHE_LEN UTTERANCE_QUEUE_LEN
+
+struct CachedUtterance {
+    uint32_t random_number;
+    int32_t n_chunks;
+    uint8_t phonetic[UTTERANCE_CHUNKS];
+    char text[TEXT_RING_MAX_UTTERANCE + 1];
+    char chunks[UTTERANCE_CHUNKS][256];
+};
+
+struct UtteranceCache {
+    uint32_t magic;
+    uint32_t count; // valid entries
+    uint32_t next;  // entry the next utterance overwrites, the oldest once full
+    CachedUtterance entries[UTTERANCE_CACHE_LEN];
+    uint32_t crc;   // over everything above
+};
+
+UtteranceCache *utterance_cache = nullptr; // in PSRAM, only the generator touches it after boot
 
 // ULN2003 Motor Driver Pins
 #define IN1 5
@@ -46,42 +118,48 @@ TaskHandle_t ledsTask = NULL;
 Adafruit_NeoPixel pixels(NUMPIXELS, PIN, NEO_GRB + NEO_KHZ800);
 #define DELAYVAL 50
 
+#define DOME_RPM 10
+#define DOME_ACCELERATION 800 // steps/s^2, reaches DOME_RPM in about 150 steps
+#define DOME_STEP_US (60L * 1000 * 1000 / stepsPerRevolution / DOME_RPM) // one step at DOME_RPM
+
 // initialize the stepper library
 Stepper myStepper(stepsPerRevolution, IN1, IN3, IN2, IN4);
 
-Transformer transformer;
+// personas the registry can switch between, all trained on the same tokenizer
+struct Persona {
+    char *name;
+    char *checkpoint_path; // e.g. out/model.bin
+};
+Persona personas[] = {
+    {(char *)"dalek", (char *)"/data/tiny_dalek.bin"},
+};
+const int n_personas = sizeof(personas) / sizeof(personas[0]);
+const int max_resident_models = 1; // checkpoints kept in RAM at once
+
+ModelRegistry models;
+Transformer *transformer = nullptr;
 Tokenizer tokenizer;
 Sampler sampler;
+Drafter drafter;
 
 void init_stepper() {
-  // set the speed at 5 rpm
-  myStepper.setSpeed(10);
+  // set the speed at 10 rpm
+  myStepper.setSpeed(DOME_RPM);
+  myStepper.setAcceleration(DOME_ACCELERATION);
 //   // initialize the serial port
 //   Serial.begin(115200);
 }
 
-void run_stepper(void *param) {
-    uint32_t random_number = *((int *)param);
-    stepper_pos = random_number * 2;
-    if (random_number % 2 == 0) {
-        stepper_pos = -stepper_pos;
-    }
-    ESP_LOGI(TAG, "stepper_pos: %d", stepper_pos);
-    while (true) {
-        // step one revolution in one direction:
-        myStepper.step(stepper_pos);
-        delay(100);
-
-        // step one revolution in the other direction:
-        myStepper.step(-stepper_pos);
-        delay(100);
-        stepper_pos = 0;
-    }
-}
+void led_engine_task(void *param);
 
 void init_leds() {
   pixels.begin();
-  //pixels.setBrightness(122); // Set BRIGHTNESS to about 4% (max = 255)
+  // frames are drawn while the previous one is still being clocked out
+  pixels.setDoubleBuffer(true);
+  // colors and the audio envelope are linear, the strip corrects them on the way out
+  pixels.setGamma(true);
+  // persistent, dark until there is audio; cheap enough to run beside the synthesis
+  xTaskCreatePinnedToCore(led_engine_task, "led_engine", 3072, NULL, 5, &ledEngineTask, 0);
 }
 
 uint32_t generate_random_number() {
@@ -94,22 +172,202 @@ uint32_t generate_random_number() {
     return random_number;
 }
 
-void run_leds(void *param) {
-    while (true) {
-        uint32_t random_number = generate_random_number();
-        pixels.clear();
-        pixels.show();
-        delay(random_number);
-        pixels.fill(pixels.Color(256 - random_number, random_number / 2, random_number));
-        pixels.show();
-        delay(random_number);
-        ESP_LOGD(TAG, "LEDs done\n");
+// the dome lights follow SAM's output level: the speaking path measures it, the LED engine
+// renders it at a fixed frame rate
+#define LED_FRAME_MS 20
+#define AUDIO_LEVEL_WINDOW (EXAMPLE_I2S_SAMPLE_RATE * LED_FRAME_MS / 1000) // samples per level, one per frame
+#define AUDIO_LEVEL_QUEUE_LEN 16    // power of two
+#define AUDIO_LEVEL_FULL_SCALE 8192 // RMS that lights the dome fully
+
+// single producer (the speaking task), single consumer (the LED engine), no locks
+struct AudioLevelQueue {
+    uint16_t levels[AUDIO_LEVEL_QUEUE_LEN];
+    std::atomic<uint32_t> head; // only written by the producer
+    std::atomic<uint32_t> tail; // only written by the consumer
+};
+
+struct LedFrameStats {
+    uint32_t frames;
+    uint32_t late;       // frames that started more than half a frame late
+    int64_t max_work_us; // longest frame render
+    int64_t total_work_us;
+};
+
+AudioLevelQueue audio_levels;
+LedFrameStats led_stats;
+std::atomic<uint32_t> led_color(0); // packed RGB at full level, set per utterance
+
+void audio_level_push(uint16_t level)
+{
+    uint32_t head = audio_levels.head.load(std::memory_order_relaxed);
+    if (head - audio_levels.tail.load(std::memory_order_acquire) == AUDIO_LEVEL_QUEUE_LEN)
+        return; // the engine is behind, drop the level rather than stall the audio
+    audio_levels.levels[head % AUDIO_LEVEL_QUEUE_LEN] = level;
+    audio_levels.head.store(head + 1, std::memory_order_release);
+}
+
+bool audio_level_pop(uint16_t *level)
+{
+    uint32_t tail = audio_levels.tail.load(std::memory_order_relaxed);
+    if (tail == audio_levels.head.load(std::memory_order_acquire))
+        return false;
+    *level = audio_levels.levels[tail % AUDIO_LEVEL_QUEUE_LEN];
+    audio_levels.tail.store(tail + 1, std::memory_order_release);
+    return true;
+}
+
+void led_engine_task(void *param)
+{
+    uint32_t envelope = 0;
+    int last_brightness = -1;
+    uint32_t last_color = 0;
+    TickType_t last_wake = xTaskGetTickCount();
+    int64_t last_start = esp_timer_get_time();
+    while (true)
+    {
+        vTaskDelayUntil(&last_wake, pdMS_TO_TICKS(LED_FRAME_MS));
+        int64_t start = esp_timer_get_time();
+        // fast attack, slow release, so the lights pulse with the syllables
+        uint16_t level;
+        uint32_t peak = 0;
+        while (audio_level_pop(&level))
+            peak = level > peak ? level : peak;
+        envelope = peak > envelope ? peak : envelope - envelope / 4;
+        int brightness = envelope >= AUDIO_LEVEL_FULL_SCALE ? 255 : envelope * 255 / AUDIO_LEVEL_FULL_SCALE;
+        uint32_t color = led_color.load(std::memory_order_relaxed);
+        if (brightness != last_brightness || color != last_color)
+        {
+            int64_t trace_start_us = trace_begin();
+            // the envelope only rebuilds the strip's brightness table, the pixels are redrawn on a new color
+            if (color != last_color)
+                pixels.fill(color);
+            pixels.setBrightness(brightness);
+            pixels.showAsync();
+            trace_end("led_frame", trace_start_us);
+            last_brightness = brightness;
+            last_color = color;
+        }
+        int64_t work_us = esp_timer_get_time() - start;
+        led_stats.frames++;
+        led_stats.total_work_us += work_us;
+        led_stats.max_work_us = work_us > led_stats.max_work_us ? work_us : led_stats.max_work_us;
+        if (start - last_start > LED_FRAME_MS * 1000 * 3 / 2)
+            led_stats.late++;
+        last_start = start;
     }
 }
 
-void turn_off_leds() {
-    pixels.clear();
-    pixels.show();
+void log_led_stats()
+{
+    LedFrameStats stats = led_stats;
+    ESP_LOGI(TAG, "LED frames: %lu, %lu late, work %lld us max, %lld us mean", (unsigned long)stats.frames,
+             (unsigned long)stats.late, stats.max_work_us, stats.frames ? stats.total_work_us / stats.frames : 0);
+    led_stats = LedFrameStats();
+}
+
+// dome and LED motion for an utterance, as keyframes on a timeline played by one persistent task
+#define ANIMATION_TICK_MS LED_FRAME_MS
+#define TIMELINE_MAX_KEYFRAMES 8
+
+struct Keyframe {
+    uint32_t at_ms;     // since the timeline started
+    int32_t dome_steps; // dome position relative to home the dome sets off for at at_ms
+    uint32_t color;     // LED color at full level, from at_ms on
+};
+
+struct Timeline {
+    int n_keyframes;
+    Keyframe keyframes[TIMELINE_MAX_KEYFRAMES]; // in time order
+};
+
+enum AnimationCommandType {
+    ANIMATION_START, // play the timeline from now
+    ANIMATION_STOP,  // abandon it and bring the dome home
+};
+
+struct AnimationCommand {
+    AnimationCommandType type;
+    Timeline timeline; // ANIMATION_START only
+};
+
+QueueHandle_t animation_commands;
+SemaphoreHandle_t animation_stopped; // given once a stopped animation has the dome home
+EventGroupHandle_t dome_events;
+#define DOME_IDLE BIT0 // set by the stepper while no move is running or queued
+
+int timeline_keyframe(Timeline *timeline, uint32_t t_ms)
+{
+    // the keyframe in effect at t_ms
+    int i = 0;
+    while (i + 1 < timeline->n_keyframes && timeline->keyframes[i + 1].at_ms <= t_ms)
+        i++;
+    return i;
+}
+
+Timeline utterance_timeline(uint32_t random_number)
+{
+    // turn the dome one way and back, as far as the random number says, changing color at the turn
+    int32_t turn = random_number * 2;
+    if (random_number % 2 == 0)
+        turn = -turn;
+    // cruising time plus the time lost speeding up and braking, v / a
+    uint32_t move_ms = abs(turn) * DOME_STEP_US / 1000 + 1000L * 1000 * 1000 / DOME_STEP_US / DOME_ACCELERATION;
+    uint32_t color = pixels.Color(256 - random_number, random_number / 2, random_number);
+    uint32_t turned = pixels.Color(random_number, 256 - random_number, random_number / 2);
+    Timeline timeline = {3, {{0, turn, color}, {move_ms, 0, turned}, {2 * move_ms + 100, 0, color}}};
+    return timeline;
+}
+
+void animation_task(void *param)
+{
+    // the stepper runs each move on its own timer, this task only hands out the keyframes
+    Timeline timeline;
+    bool playing = false;
+    int keyframe = -1;
+    int64_t start_us = 0;
+    TickType_t last_wake = xTaskGetTickCount();
+    while (true)
+    {
+        // idle, wait for a command; otherwise only check for one every tick
+        AnimationCommand command;
+        if (xQueueReceive(animation_commands, &command, playing ? 0 : portMAX_DELAY) == pdTRUE)
+        {
+            playing = command.type == ANIMATION_START;
+            if (!playing)
+            {
+                // the running move finishes, the rest are dropped for the way home; the stepper
+                // keeps counting steps across utterances, so every one starts from home
+                myStepper.moveHome();
+                xEventGroupWaitBits(dome_events, DOME_IDLE, pdFALSE, pdTRUE, portMAX_DELAY);
+                xSemaphoreGive(animation_stopped);
+                continue;
+            }
+            timeline = command.timeline;
+            keyframe = -1;
+            start_us = esp_timer_get_time();
+            last_wake = xTaskGetTickCount();
+        }
+
+        if (playing)
+        {
+            int k = timeline_keyframe(&timeline, (esp_timer_get_time() - start_us) / 1000);
+            for (keyframe++; keyframe <= k; keyframe++)
+                myStepper.moveTo(timeline.keyframes[keyframe].dome_steps);
+            keyframe = k;
+            led_color.store(timeline.keyframes[k].color, std::memory_order_relaxed);
+        }
+        vTaskDelayUntil(&last_wake, pdMS_TO_TICKS(ANIMATION_TICK_MS));
+    }
+}
+
+void init_animation()
+{
+    animation_commands = xQueueCreate(2, sizeof(AnimationCommand));
+    animation_stopped = xSemaphoreCreateBinary();
+    dome_events = xEventGroupCreate();
+    myStepper.setIdleEvent(dome_events, DOME_IDLE);
+    // owns the stepper; on the core the generator's workers leave alone
+    xTaskCreatePinnedToCore(animation_task, "animation", 3072, NULL, 5, &animationTask, 0);
 }
 
 /**
@@ -118,10 +376,6 @@ void turn_off_leds() {
  */
  void init_audio(void)
  {
-    size_t bytes_written;
-    int i2s_read_len = EXAMPLE_I2S_READ_LEN;
-    uint8_t* i2s_write_buff = (uint8_t*) calloc(i2s_read_len, sizeof(char));
-
     example_i2s_init();
     example_set_file_play_mode();
     ESP_LOGI(TAG, "Audio initialized");
@@ -176,6 +430,17 @@ void init_storage(void)
 bool output_audio(void *cbdata, int16_t* b) {
     size_t bytes_written;
     i2s_write((i2s_port_t)0, b, 2, &bytes_written, portMAX_DELAY);
+
+    // one RMS level per LED frame for the engine
+    static int64_t level_sum = 0;
+    static int level_samples = 0;
+    level_sum += (int32_t)b[0] * b[0];
+    if (++level_samples == AUDIO_LEVEL_WINDOW)
+    {
+        audio_level_push((uint16_t)sqrtf((float)level_sum / AUDIO_LEVEL_WINDOW));
+        level_sum = 0;
+        level_samples = 0;
+    }
     return true;
 }
 
@@ -183,54 +448,68 @@ bool output_audio(void *cbdata, int16_t* b) {
  * @brief Outputs to display
  *
  * @param text The text to output
+ * @param phonetic Whether text already holds SAM phonemes
  */
-void say_chunk(char *text)
+void say_chunk(char *text, bool phonetic)
 {
     ESP8266SAM *sam = new ESP8266SAM(output_audio);
     sam->SetSpeed(120);
     sam->SetPitch(100);
     sam->SetThroat(100);
     sam->SetMouth(200);
+    sam->SetPhonetic(phonetic);
     sam->Say(text);
     ESP_LOGI(TAG, "Audio output complete");
     //vTaskDelay(500 / portTICK_RATE_MS);
     delete sam;
 }
 
-void say_text(char *text)
+void phonemize_utterance(Utterance *u)
 {
-        // say in chunks of 128 characters
-    int len = strlen(text);
-    int start = 0;
-    int end = 64;
-    while (start < len)
+    // split into chunks SAM can take and convert each one to phonemes
+    ESP8266SAM sam(output_audio);
+    int len = strlen(u->text);
+    u->n_chunks = 0;
+    xSemaphoreTake(sam_lock, portMAX_DELAY);
+    for (int start = 0; start < len && u->n_chunks < UTTERANCE_CHUNKS; start += SAY_CHUNK_LEN)
     {
-        if (end > len)
+        int end = start + SAY_CHUNK_LEN < len ? start + SAY_CHUNK_LEN : len;
+        char chunk[SAY_CHUNK_LEN + 1];
+        memcpy(chunk, u->text + start, end - start);
+        chunk[end - start] = '\0';
+        int c = u->n_chunks++;
+        u->phonetic[c] = sam.Phonemize(chunk, u->chunks[c], sizeof(u->chunks[c]));
+        if (!u->phonetic[c])
         {
-            end = len;
+            // let Say convert it again, it reports the failure
+            strcpy(u->chunks[c], chunk);
         }
-        char *chunk = (char *)malloc(end - start + 1);
-        memcpy(chunk, text + start, end - start);
-        chunk[end - start] = '\0';
-        ESP_LOGI(TAG, "Saying: %s", chunk);
-        say_chunk(chunk);
-        start = end;
-        end += 64;
     }
+    xSemaphoreGive(sam_lock);
 }
 
-void say_with_animation(uint32_t random_number) {
-    // start stepper and leds using freertos threads
-    xTaskCreate(run_stepper, "run_stepper", 4096, &random_number, 5, &stepperTask);
-    xTaskCreate(run_leds, "run_leds", 4096, &random_number, 5, &ledsTask);
-    say_text(text);
-    vTaskDelete(ledsTask);
-    turn_off_leds();
-    while (stepper_pos != 0)
+void say_utterance(Utterance *u)
+{
+    xSemaphoreTake(sam_lock, portMAX_DELAY);
+    for (int c = 0; c < u->n_chunks; c++)
     {
-        delay(10);
+        ESP_LOGI(TAG, "Saying: %s", u->chunks[c]);
+        say_chunk(u->chunks[c], u->phonetic[c]);
     }
-    vTaskDelete(stepperTask);
+    xSemaphoreGive(sam_lock);
+}
+
+void say_with_animation(Utterance *u) {
+    TraceScope trace("say_with_animation");
+    // the timeline starts with the speech and is cut off with it, the LED engine adds the
+    // audio level to its colors and goes dark after the last word
+    AnimationCommand command = {ANIMATION_START, utterance_timeline(u->random_number)};
+    xQueueSend(animation_commands, &command, portMAX_DELAY);
+    say_utterance(u);
+    command.type = ANIMATION_STOP;
+    xQueueSend(animation_commands, &command, portMAX_DELAY);
+    xSemaphoreTake(animation_stopped, portMAX_DELAY);
+    log_led_stats();
 }
 
 /**
@@ -240,32 +519,98 @@ void say_with_animation(uint32_t random_number) {
  */
 void generate_complete_cb(char *generated_text, int ix, float tk_s)
 {
-    //truncate the generated text to ix
-    text = (char *)malloc(ix);
-    memcpy(text, generated_text, ix);
+    // the text ring keeps the utterance alive until several more have been generated
+    text = generated_text;
 
     ESP_LOGI(TAG, "Generated text: %s", text);
     ESP_LOGI(TAG, "Tokens per second: %.2f", tk_s);
-    // say_text(text);
-    // say_with_animation(text);
+    mem_telemetry_dump("utterance");
+}
+
+void boot_stage_begin(BootStage stage)
+{
+    boot_stage_us[stage][0] = esp_timer_get_time();
+}
+
+void boot_stage_end(BootStage stage)
+{
+    boot_stage_us[stage][1] = esp_timer_get_time();
+    xEventGroupSetBits(boot_events, BOOT_BIT(stage));
+}
+
+void boot_wait(EventBits_t bits)
+{
+    xEventGroupWaitBits(boot_events, bits, pdFALSE, pdTRUE, portMAX_DELAY);
+}
+
+void log_boot_times()
+{
+    ESP_LOGI(TAG, "Boot took %lld ms", esp_timer_get_time() / 1000);
+    for (int i = 0; i < BOOT_STAGES; i++)
+    {
+        ESP_LOGI(TAG, "  %-9s %6lld ms .. %6lld ms, %6lld ms", boot_stage_names[i], boot_stage_us[i][0] / 1000,
+                 boot_stage_us[i][1] / 1000, (boot_stage_us[i][1] - boot_stage_us[i][0]) / 1000);
+    }
+}
+
+void log_checkpoint_progress(const char *checkpoint, size_t done, size_t total)
+{
+    // about every quarter, the loader calls this after each CHECKPOINT_CHUNK
+    int quarter = done * 4 / total;
+    int previous = (done > CHECKPOINT_CHUNK ? done - CHECKPOINT_CHUNK : 0) * 4 / total;
+    if (quarter != previous)
+        ESP_LOGI(TAG, "Loading %s: %d%%", checkpoint, quarter * 25);
 }
 
-void init_llm(uint32_t random_number) {
+void init_model(uint32_t random_number) {
+    set_checkpoint_progress(log_checkpoint_progress);
+
+    // register the personas and build the first Transformer via its model .bin file
+    registry_init(&models, max_resident_models);
+    for (int i = 0; i < n_personas; i++) {
+        ESP_LOGI(TAG, "LLM %s path is %s", personas[i].name, personas[i].checkpoint_path);
+        registry_add(&models, personas[i].name, personas[i].checkpoint_path);
+    }
+    transformer = registry_select(&models, personas[random_number % n_personas].name);
+    if (steps == 0 || steps > transformer->config.seq_len)
+        steps = transformer->config.seq_len; // override to ~max length
+}
+
+void init_tokenizer(uint32_t random_number) {
     // parameter validation/overrides
     if (rng_seed <= 0)
         rng_seed = random_number;
 
-    // build the Transformer via the model .bin file
-    ESP_LOGI(TAG, "LLM Path is %s", checkpoint_path);
-    build_transformer(&transformer, checkpoint_path);
-    if (steps == 0 || steps > transformer.config.seq_len)
-        steps = transformer.config.seq_len; // override to ~max length
+    // the vocab size comes from the checkpoint header, so this doesn't wait for the weights
+    Config config;
+    read_config(personas[random_number % n_personas].checkpoint_path, &config);
 
     // build the Tokenizer via the tokenizer .bin file
-    build_tokenizer(&tokenizer, tokenizer_path, transformer.config.vocab_size);
+    build_tokenizer(&tokenizer, tokenizer_path, config.vocab_size);
 
     // build the Sampler
-    build_sampler(&sampler, transformer.config.vocab_size, temperature, topp, rng_seed);
+    build_sampler(&sampler, config.vocab_size, temperature, topp, rng_seed);
+
+    // build the Drafter for speculative decoding
+    build_drafter(&drafter, &tokenizer, max_draft, draft_ngram, phrases_path);
+}
+
+void storage_task(void *param)
+{
+    boot_stage_begin(BOOT_STORAGE);
+    init_storage();
+    boot_stage_end(BOOT_STORAGE);
+    vTaskDelete(NULL);
+}
+
+void tokenizer_task(void *param)
+{
+    uint32_t random_number = (uint32_t)(uintptr_t)param;
+    boot_wait(BOOT_BIT(BOOT_STORAGE));
+    boot_stage_begin(BOOT_TOKENIZER);
+    init_tokenizer(random_number);
+    boot_stage_end(BOOT_TOKENIZER);
+    vTaskDelete(NULL);
 }
 
 void generate_text(uint32_t random_number)
@@ -287,27 +632,189 @@ void generate_text(uint32_t random_number)
         prompt[1] = '\0';
     }
 
+    // pick the persona for this utterance, swapping models between utterances only
+    transformer = registry_select(&models, personas[random_number % n_personas].name);
+    int n_steps = steps > transformer->config.seq_len ? transformer->config.seq_len : steps;
+
     printf("Prompt is %s\n", prompt);
 
     // run!
-    generate(&transformer, &tokenizer, &sampler, prompt, steps, &generate_complete_cb);
+    generate(transformer, &tokenizer, &sampler, &drafter, prompt, n_steps, &generate_complete_cb);
     free(prompt);
 }
 
+uint32_t utterance_cache_crc(UtteranceCache *cache)
+{
+    return esp_rom_crc32_le(0, (const uint8_t *)cache, offsetof(UtteranceCache, crc));
+}
+
+bool read_utterance_cache(const char *path, UtteranceCache *cache)
+{
+    FILE *file = fopen(path, "rb");
+    if (!file)
+        return false;
+    bool ok = fread(cache, sizeof(UtteranceCache), 1, file) == 1 && cache->magic == UTTERANCE_CACHE_MAGIC &&
+              cache->count <= UTTERANCE_CACHE_LEN && cache->next < UTTERANCE_CACHE_LEN &&
+              cache->crc == utterance_cache_crc(cache);
+    fclose(file);
+    // the CRC only catches damage, the entries still have to fit the Utterance they are copied into
+    for (uint32_t i = 0; ok && i < cache->count; i++)
+    {
+        CachedUtterance *e = &cache->entries[(cache->next + UTTERANCE_CACHE_LEN - cache->count + i) % UTTERANCE_CACHE_LEN];
+        ok = e->n_chunks >= 0 && e->n_chunks <= UTTERANCE_CHUNKS && e->text[TEXT_RING_MAX_UTTERANCE] == '\0';
+    }
+    return ok;
+}
+
+void load_utterance_cache()
+{
+    // queue the cached utterances, oldest first. only at boot, before the generator starts
+    utterance_cache = (UtteranceCache *)heap_caps_calloc(1, sizeof(UtteranceCache), MALLOC_CAP_SPIRAM | MALLOC_CAP_8BIT);
+    if (utterance_cache == nullptr)
+    {
+        ESP_LOGW(TAG, "No memory for the utterance cache");
+        return;
+    }
+    // a reboot between removing the old file and renaming the new one leaves only the temporary
+    if (!read_utterance_cache(UTTERANCE_CACHE_PATH, utterance_cache) &&
+        !read_utterance_cache(UTTERANCE_CACHE_TMP, utterance_cache))
+    {
+        ESP_LOGI(TAG, "No utterance cache");
+        memset(utterance_cache, 0, sizeof(UtteranceCache));
+        utterance_cache->magic = UTTERANCE_CACHE_MAGIC;
+        return;
+    }
+    for (uint32_t i = 0; i < utterance_cache->count; i++)
+    {
+        uint32_t index = (utterance_cache->next + UTTERANCE_CACHE_LEN - utterance_cache->count + i) % UTTERANCE_CACHE_LEN;
+        CachedUtterance *e = &utterance_cache->entries[index];
+        Utterance *u;
+        xQueueReceive(free_utterances, &u, portMAX_DELAY);
+        u->text = text_ring_put(e->text);
+        u->random_number = e->random_number;
+        u->n_chunks = e->n_chunks;
+        for (int c = 0; c < u->n_chunks; c++)
+        {
+            u->phonetic[c] = e->phonetic[c];
+            memcpy(u->chunks[c], e->chunks[c], sizeof(u->chunks[c]));
+        }
+        xQueueSend(ready_utterances, &u, portMAX_DELAY);
+    }
+    ESP_LOGI(TAG, "%lu utterances restored from cache", (unsigned long)utterance_cache->count);
+}
+
+void save_utterance(Utterance *u)
+{
+    // runs on the generator task, so the flash write stays off the speaking path
+    if (utterance_cache == nullptr)
+        return;
+    CachedUtterance *e = &utterance_cache->entries[utterance_cache->next];
+    e->random_number = u->random_number;
+    e->n_chunks = u->n_chunks;
+    strlcpy(e->text, u->text, sizeof(e->text));
+    for (int c = 0; c < u->n_chunks; c++)
+    {
+        e->phonetic[c] = u->phonetic[c];
+        memcpy(e->chunks[c], u->chunks[c], sizeof(e->chunks[c]));
+    }
+    utterance_cache->next = (utterance_cache->next + 1) % UTTERANCE_CACHE_LEN;
+    if (utterance_cache->count < UTTERANCE_CACHE_LEN)
+        utterance_cache->count++;
+    utterance_cache->crc = utterance_cache_crc(utterance_cache);
+
+    // write a new file and swap it in, so a brownout mid-write keeps the previous cache
+    FILE *file = fopen(UTTERANCE_CACHE_TMP, "wb");
+    if (!file)
+    {
+        ESP_LOGW(TAG, "Couldn't write %s", UTTERANCE_CACHE_TMP);
+        return;
+    }
+    bool ok = fwrite(utterance_cache, sizeof(UtteranceCache), 1, file) == 1;
+    ok = fclose(file) == 0 && ok;
+    if (!ok)
+    {
+        ESP_LOGW(TAG, "Couldn't write %s", UTTERANCE_CACHE_TMP);
+        return;
+    }
+    unlink(UTTERANCE_CACHE_PATH);
+    rename(UTTERANCE_CACHE_TMP, UTTERANCE_CACHE_PATH);
+}
+
+void generator_task(void *param)
+{
+    // the model loads here, in the background, while cached utterances answer the first triggers.
+    // the tokenizer loads alongside it on the other core, idle until the first forward pass
+    uint32_t random_number = generate_random_number();
+    xTaskCreatePinnedToCore(tokenizer_task, "tokenizer", 4096, (void *)(uintptr_t)random_number, tskIDLE_PRIORITY + 1, NULL, 1);
+    boot_wait(BOOT_BIT(BOOT_STORAGE));
+    boot_stage_begin(BOOT_MODEL);
+    init_model(random_number);
+    boot_stage_end(BOOT_MODEL);
+    boot_wait(BOOT_ALL);
+    log_boot_times();
+    mem_telemetry_dump("model loaded");
+
+    // keep the ready queue full, running whenever the speaking path is blocked
+    Utterance *u;
+    while (true)
+    {
+        xQueueReceive(free_utterances, &u, portMAX_DELAY);
+        u->random_number = generate_random_number();
+        text = nullptr;
+        generate_text(u->random_number);
+        if (text == nullptr || text[0] == '\0')
+        {
+            // nothing came out, try again with another prompt
+            xQueueSend(free_utterances, &u, portMAX_DELAY);
+            continue;
+        }
+        u->text = text;
+        phonemize_utterance(u);
+        save_utterance(u);
+        xQueueSend(ready_utterances, &u, portMAX_DELAY);
+        ESP_LOGI(TAG, "%d utterances ready", (int)uxQueueMessagesWaiting(ready_utterances));
+    }
+}
+
+void init_generator()
+{
+    sam_lock = xSemaphoreCreateMutex();
+    free_utterances = xQueueCreate(UTTERANCE_QUEUE_LEN + 2, sizeof(Utterance *));
+    ready_utterances = xQueueCreate(UTTERANCE_QUEUE_LEN, sizeof(Utterance *));
+    utterances = (Utterance *)heap_caps_calloc_prefer(UTTERANCE_QUEUE_LEN + 2, sizeof(Utterance), 2,
+                                                      MALLOC_CAP_SPIRAM | MALLOC_CAP_8BIT, MALLOC_CAP_8BIT);
+    for (int i = 0; i < UTTERANCE_QUEUE_LEN + 2; i++)
+    {
+        Utterance *u = &utterances[i];
+        xQueueSend(free_utterances, &u, 0);
+    }
+    boot_wait(BOOT_BIT(BOOT_STORAGE));
+    boot_stage_begin(BOOT_CACHE);
+    load_utterance_cache();
+    boot_stage_end(BOOT_CACHE);
+    // below the speaking path, so generation only uses the time it spends waiting
+    vTaskPrioritySet(NULL, tskIDLE_PRIORITY + 2);
+    xTaskCreatePinnedToCore(generator_task, "generator", 6144, NULL, tskIDLE_PRIORITY + 1, &generatorTask, 0);
+}
+
 extern "C" void app_main()
 {
     //initArduino();
     //Serial.begin(115200);
     pinMode(23, INPUT);
 
-    uint32_t random_number = generate_random_number();
-
+    // mounting SPIFFS dominates the early boot, the outputs come up meanwhile
+    boot_events = xEventGroupCreate();
+    xTaskCreatePinnedToCore(storage_task, "storage", 4096, NULL, tskIDLE_PRIORITY + 2, NULL, 1);
+    boot_stage_begin(BOOT_OUTPUTS);
     init_leds();
     init_stepper();
-    init_storage();
-    init_llm(random_number);
-
-    generate_text(random_number);
+    init_animation();
+    boot_stage_end(BOOT_OUTPUTS);
+    mem_telemetry_dump("boot");
+    if (trace_enabled)
+        trace_start();
+    init_generator();
 
     while (true)
     {
@@ -320,15 +827,20 @@ extern "C" void app_main()
             }
             delay(50);
         }
+        // normally ready already, only right after boot does this wait for the generator
+        Utterance *u;
+        long start = millis();
+        xQueueReceive(ready_utterances, &u, portMAX_DELAY);
+        ESP_LOGI(TAG, "Utterance served after %ld ms", millis() - start);
         init_audio();
-        say_with_animation(random_number);
+        say_with_animation(u);
         deinit_audio();
-        random_number = generate_random_number();
-        generate_text(random_number);
-        // deinit the audio
-
+        xQueueSend(free_utterances, &u, portMAX_DELAY);
+        if (trace_enabled) {
+            // speaking this utterance, and generating the ones behind it
+            trace_export(stdout);
+            trace_clear();
+        }
     }
 
-    //run_leds(nullptr);
-    //run_stepper(nullptr);
 }
\ No newline at end of file
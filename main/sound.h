@@ -2,6 +2,7 @@
 #include "driver/adc.h"
 #include "esp_adc_cal.h"
 #include "esp_rom_sys.h"
+#include "mem_telemetry.h"
 
 //i2s number
 #define EXAMPLE_I2S_NUM           (i2s_port_t)(0)
@@ -17,6 +18,11 @@
 #define EXAMPLE_I2S_FORMAT        (I2S_CHANNEL_FMT_RIGHT_LEFT)
 //I2S channel number
 #define EXAMPLE_I2S_CHANNEL_NUM   ((EXAMPLE_I2S_FORMAT < I2S_CHANNEL_FMT_ONLY_RIGHT) ? (2) : (1))
+//I2S DMA buffers, per direction
+#define EXAMPLE_I2S_DMA_BUF_COUNT (6)
+#define EXAMPLE_I2S_DMA_BUF_LEN   (256)
+//bytes the driver allocates for DMA, rx and tx
+#define EXAMPLE_I2S_DMA_BYTES     (2 * EXAMPLE_I2S_DMA_BUF_COUNT * EXAMPLE_I2S_DMA_BUF_LEN * EXAMPLE_I2S_CHANNEL_NUM * EXAMPLE_I2S_SAMPLE_BITS / 8)
 //I2S built-in ADC unit
 #define I2S_ADC_UNIT              ADC_UNIT_1
 //I2S built-in ADC channel
@@ -34,12 +40,13 @@ void example_i2s_init(void)
         .channel_format = I2S_CHANNEL_FMT_RIGHT_LEFT,
         .communication_format = I2S_COMM_FORMAT_STAND_MSB,
         .intr_alloc_flags = 0,
-        .dma_buf_count = 6,
-        .dma_buf_len = 256,
+        .dma_buf_count = EXAMPLE_I2S_DMA_BUF_COUNT,
+        .dma_buf_len = EXAMPLE_I2S_DMA_BUF_LEN,
         .use_apll = 1,
      };
      //install and start i2s driver
      i2s_driver_install((i2s_port_t)0, &i2s_config, 0, NULL);
+     mem_telemetry_alloc(MEM_I2S_DMA, EXAMPLE_I2S_DMA_BYTES);
      //init DAC pad
      i2s_set_dac_mode(I2S_DAC_CHANNEL_BOTH_EN);
      //init ADC pad
@@ -49,6 +56,7 @@ void example_i2s_init(void)
 void deinit_audio(void)
 {
     i2s_driver_uninstall(EXAMPLE_I2S_NUM);
+    mem_telemetry_free(MEM_I2S_DMA, EXAMPLE_I2S_DMA_BYTES);
 }
 
 /**